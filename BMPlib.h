@@ -11,12 +11,75 @@
 
     #define BMPLIB_SILENT
     if you want bmplib to stop writing exceptions to stderr
+
+    #define BMPLIB_NO_SIMD
+    if you want bmplib to only use its plain scalar pixel loops
+
+    #define BMPLIB_NO_IO_URING
+    if you want ReadAsync() and WriteAsync() to stick to a helper thread instead of io_uring (linux)
+
+    #define BMPLIB_INSTRUMENT
+    if you want bmplib to time every phase of Read(), Write(), ReInitialize() and ConvertTo() (see BMPlib::Instrumentation)
 */
 
 #pragma once
 #include <sstream>
 #include <fstream>
 #include <string.h>
+#include <stdlib.h>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#if !defined(BMPLIB_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define BMPLIB_IO_URING
+#endif
+#endif
+#endif
+#endif
+
+#if !defined(BMPLIB_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define BMPLIB_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// msvc lets us use every instruction set without asking
+#define BMPLIB_TARGET(isa)
+#else
+// g++/clang need to be told which functions may use which instruction set, since we do not want to require -mavx2
+#define BMPLIB_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+#ifdef BMPLIB_INSTRUMENT
+#include <chrono>
+#include <cstdint>
+// Every instrumented call gets a recorder, and books its phases onto it as it goes
+#define BMPLIB_INSTRUMENT_CALL(operation) BMPlib::Instrumentation::CallRecorder bmplibRecorder(BMPlib::Instrumentation::OPERATION::operation)
+#define BMPLIB_INSTRUMENT_LAP(phase, bytes) bmplibRecorder.Lap(BMPlib::Instrumentation::PHASE::phase, bytes)
+#else
+#define BMPLIB_INSTRUMENT_CALL(operation)
+#define BMPLIB_INSTRUMENT_LAP(phase, bytes)
+#endif
 
 #define BMPLIB_VERSION 0.602
 
@@ -60,579 +123,5986 @@ namespace BMPlib
         return is;
     }
 
-    class BMP
+    template<typename T>
+    // Will write (int)15 as 0F 00 00 00 to dst and return the position right after it
+    byte* ToBytes(T t, byte* dst)
     {
-    public:
-        enum class COLOR_MODE
-        {
-            BW, // This is a special case, since BMP doesn't support 1 channel. It is just RGB, but with a 1-channel pixel buffer
-            RGB,
-            RGBA
-        };
+        for (std::size_t i = 0; i < sizeof(T); i++)
+            *dst++ = (byte)((t >> (i * 8)) & 0xFF);
 
-        BMP() noexcept
+        return dst;
+    }
+
+    template<typename T>
+    // Will read 0F 00 00 00 from src as 15 and return the position right after it
+    const byte* FromBytes(const byte* src, T& b)
+    {
+        b = 0x0;
+        for (std::size_t i = 0; i < sizeof(T); i++)
+            b |= (T)((T)*src++ << (i * 8));
+
+        return src;
+    }
+
+    // BMP header + DIB header (BITMAPINFOHEADER), as they lie in the first 54 bytes of a bmp file
+    struct BitmapHeader
+    {
+        static constexpr std::size_t size = 0x36; // size of both headers
+
+        byte2 signature = 0x4D42;
+        byte4 fileSize = 0;             // size of the bmp file (all bytes)
+        byte2 unused0 = 0;
+        byte2 unused1 = 0;
+        byte4 offsetPixelArray = 0x36;  // Offset where the pixel array begins
+        byte4 dibHeadLen = 0x28;        // Number of bytes in DIB header
+        byte4 imgWidth = 0;
+        byte4 imgHeight = 0;
+        byte2 numPlanes = 1;
+        byte2 bitDepth = 0;
+        byte4 compression = 0;
+        byte4 sizeofPixelArray = 0;     // Size of raw bitmap data (including padding)
+        byte4 printresX = 0xB13;        // print resolution pixels/meter X
+        byte4 printresY = 0xB13;        // print resolution pixels/meter Y
+        byte4 colorsInPalette = 0;
+        byte4 importantColors = 0;      // 0 means all colors are important
+
+        // Will write all 54 header bytes to dst
+        void Encode(byte* dst) const noexcept
         {
-            width = 0;
-            height = 0;
-            colorMode = COLOR_MODE::BW;
-            sizeofPxlbfr = 0;
-            numChannelsFile = 0;
-            numChannelsPXBF = 0;
-            pixelbfr = nullptr;
-            isInitialized = false;
+            dst = ToBytes(signature, dst);
+            dst = ToBytes(fileSize, dst);
+            dst = ToBytes(unused0, dst);
+            dst = ToBytes(unused1, dst);
+            dst = ToBytes(offsetPixelArray, dst);
+            dst = ToBytes(dibHeadLen, dst);
+            dst = ToBytes(imgWidth, dst);
+            dst = ToBytes(imgHeight, dst);
+            dst = ToBytes(numPlanes, dst);
+            dst = ToBytes(bitDepth, dst);
+            dst = ToBytes(compression, dst);
+            dst = ToBytes(sizeofPixelArray, dst);
+            dst = ToBytes(printresX, dst);
+            dst = ToBytes(printresY, dst);
+            dst = ToBytes(colorsInPalette, dst);
+            ToBytes(importantColors, dst);
             return;
         }
 
-        explicit BMP(const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode = BMP::COLOR_MODE::RGB)
-            : isInitialized{false}
+        // Will read all 54 header bytes from src. Returns false if src doesn't start with the bmp signature
+        bool Decode(const byte* src) noexcept
         {
-            ReInitialize(width, height, colorMode);
-            return;
+            src = FromBytes(src, signature);
+            src = FromBytes(src, fileSize);
+            src = FromBytes(src, unused0);
+            src = FromBytes(src, unused1);
+            src = FromBytes(src, offsetPixelArray);
+            src = FromBytes(src, dibHeadLen);
+            src = FromBytes(src, imgWidth);
+            src = FromBytes(src, imgHeight);
+            src = FromBytes(src, numPlanes);
+            src = FromBytes(src, bitDepth);
+            src = FromBytes(src, compression);
+            src = FromBytes(src, sizeofPixelArray);
+            src = FromBytes(src, printresX);
+            src = FromBytes(src, printresY);
+            src = FromBytes(src, colorsInPalette);
+            FromBytes(src, importantColors);
+
+            return signature == 0x4D42;
         }
 
-        void ReInitialize(const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode = BMP::COLOR_MODE::RGB)
+        // Will return how many bytes a scanline takes up in the file, including padding
+        std::size_t GetPaddedRowSize() const noexcept
         {
-            if ((!width) || (!height)) ThrowException("Bad image dimensions!");
+            return (((std::size_t)imgWidth * bitDepth + 31) / 32) * 4;
+        }
 
-            // Initialize bunch of stuff
-            this->width = width;
-            this->height = height;
-            this->colorMode = colorMode;
+        // A negative height means the scanlines are stored top to bottom, instead of the usual bottom to top
+        bool IsTopDown() const noexcept
+        {
+            return (imgHeight & 0x80000000) != 0;
+        }
 
-            switch (colorMode)
-            {
-            case COLOR_MODE::BW:
-                numChannelsFile = 3;
-                numChannelsPXBF = 1;
-                break;
-            case COLOR_MODE::RGB:
-                numChannelsFile = 3;
-                numChannelsPXBF = 3;
-                break;
-            case COLOR_MODE::RGBA:
-                numChannelsFile = 4;
-                numChannelsPXBF = 4;
-                break;
-            }
+        // Will return the height in pixels, whichever way the scanlines are stored
+        std::size_t GetHeight() const noexcept
+        {
+            return IsTopDown() ? (std::size_t)(0u - imgHeight) : (std::size_t)imgHeight;
+        }
+    };
 
-            // Delete pixelbuffer if already exists
-            if (isInitialized) delete[] pixelbfr;
-            sizeofPxlbfr = sizeof(byte) * width * height * numChannelsPXBF;
+    // Pixel loops that lie underneath the pixel buffer conversions.
+    // Every kernel has a plain scalar version, and picks a faster one at runtime, if the cpu supports it.
+    namespace Kernels
+    {
+        struct CpuFeatures
+        {
+            bool sse2 = false;
+            bool ssse3 = false;
+            bool avx2 = false;
+        };
 
-            // Try to allocate memory for the pixelbuffer
-            try
-            {
-                pixelbfr = new byte[sizeofPxlbfr];
-            }
-            catch (std::bad_alloc& e)
+        // Will find out once which instruction sets we are allowed to use
+        inline const CpuFeatures& GetCpuFeatures() noexcept
+        {
+            static const CpuFeatures features = []() noexcept
             {
-                // too bad!
-                ThrowException(std::string("Can't allocate memory for pixelbuffer!") + e.what());
-            }
+                CpuFeatures f;
+#if defined(BMPLIB_X86_SIMD) && defined(_MSC_VER)
+                int info[4];
+                __cpuid(info, 0);
+                const int maxLeaf = info[0];
 
-            // Make image black
-            memset(pixelbfr, 0, sizeofPxlbfr);
+                __cpuid(info, 1);
+                f.sse2  = (info[3] & (1 << 26)) != 0;
+                f.ssse3 = (info[2] & (1 <<  9)) != 0;
+                const bool osSavesYmm = ((info[2] & (1 << 27)) != 0) && ((_xgetbv(0) & 0x6) == 0x6);
 
-            isInitialized = true;
-            return;
+                if ((maxLeaf >= 7) && (osSavesYmm))
+                {
+                    __cpuidex(info, 7, 0);
+                    f.avx2 = (info[1] & (1 << 5)) != 0;
+                }
+#elif defined(BMPLIB_X86_SIMD)
+                __builtin_cpu_init();
+                f.sse2  = __builtin_cpu_supports("sse2");
+                f.ssse3 = __builtin_cpu_supports("ssse3");
+                f.avx2  = __builtin_cpu_supports("avx2");
+#endif
+                return f;
+            }();
+
+            return features;
         }
 
-#ifdef __linux__
-#pragma GCC diagnostic push
-// g++ doesn't see the parameters, numPx, and curPx getting used inside the switch... we don't want these false warnings
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#endif
-        // Will convert between color modes. Set isNonColorData to true to treat pixeldata as raw values rather than color
-        void ConvertTo(const BMP::COLOR_MODE& convto, bool isNonColorData = false)
+#ifdef BMPLIB_X86_SIMD
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t SwapRB24_SSSE3(const byte* src, byte* dst, const std::size_t& numPx) noexcept
         {
-            // Damn this method is one hell of a mess
-
-            if (!isInitialized)
-                ThrowException("Not initialized!");
+            // 5 pixels per 16 byte register. The 16th byte belongs to the next pixel, so it just gets passed through
+            const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
 
-            byte* tmp_pxlbfr;
-            try
-            {
-                tmp_pxlbfr = new byte[sizeofPxlbfr];
-            }
-            catch (std::bad_alloc&e )
+            std::size_t i = 0;
+            for (; (i + 6) <= numPx; i += 5)
             {
-                // too bad!
-                ThrowException(std::string("Can't allocate memory for temporary conversion pixelbuffer!") + e.what());
-                return; // This won't ever be reached but it satisfies the compiler, soooo...
+                const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(px, shuffle));
             }
-            const std::size_t numPx = width * height;
-            const std::size_t oldPxlbfrSize = sizeofPxlbfr;
-            const byte* curPx; // Usage may vary on the conversion in question. It's just a pixel cache for a small performance improvement
-            memcpy(tmp_pxlbfr, pixelbfr, sizeofPxlbfr);
-
-#ifdef __linux__
-#pragma GCC diagnostic pop // Let's enable these warnings again
-#endif
 
-            switch (colorMode)
-            {
-            case COLOR_MODE::BW:
-#ifndef __linux__
-#pragma region CONVERT_FROM_BW
-#endif
-                switch (convto)
-                {
-                case COLOR_MODE::RGB:
-                    // BW -> RGB
+            return i;
+        }
 
-                    ReInitialize(width, height, COLOR_MODE::RGB);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i;
-                        pixelbfr[i * 3 + 0] = *curPx;
-                        pixelbfr[i * 3 + 1] = *curPx;
-                        pixelbfr[i * 3 + 2] = *curPx;
-                    }
+        BMPLIB_TARGET("avx2")
+        inline std::size_t SwapRB24_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            // 4 pixels per 128 bit lane. The lanes get loaded 12 bytes apart, and get packed back together after the shuffle
+            const __m256i shuffle = _mm256_setr_epi8(
+                2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1,
+                2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+            const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
 
-                    break;
-                case COLOR_MODE::RGBA:
-                    // BW -> RGBA
+            std::size_t i = 0;
+            for (; (i * 3 + 28) <= numPx * 3; i += 8)
+            {
+                const __m256i px = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + i * 3))),
+                    _mm_loadu_si128((const __m128i*)(src + i * 3 + 12)), 1);
 
-                    ReInitialize(width, height, COLOR_MODE::RGBA);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i;
-                        pixelbfr[i * 4 + 0] = *curPx;
-                        pixelbfr[i * 4 + 1] = *curPx;
-                        pixelbfr[i * 4 + 2] = *curPx;
-                        pixelbfr[i * 4 + 3] = 0xFF;
-                    }
-                    break;
+                const __m256i swapped = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, shuffle), pack);
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm256_castsi256_si128(swapped));
+                _mm_storel_epi64((__m128i*)(dst + i * 3 + 16), _mm256_extracti128_si256(swapped, 1));
+            }
 
-                default:
-                    break;
-                }
-#ifndef __linux__
-#pragma endregion
-#endif
-                break;
+            return i;
+        }
 
-            case COLOR_MODE::RGB:
-#ifndef __linux__
-#pragma region CONVERT_FROM_RGB
-#endif
-                switch (convto)
-                {
-                case COLOR_MODE::BW:
-                    // RGB -> BW
+        BMPLIB_TARGET("sse2")
+        inline std::size_t SwapRB32_SSE2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m128i maskGA = _mm_set1_epi32((int)0xFF00FF00);
+            const __m128i maskB  = _mm_set1_epi32(0x000000FF);
 
-                    ReInitialize(width, height, COLOR_MODE::BW);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i * 3;
-
-                        // Don't ask me why but the compiler hates dereferencing tmp_pxlbfr/curPx via [] and throws false warnings...
-                        if (isNonColorData)
-                            pixelbfr[i] = (byte)((
-                                *(curPx + 0) + 
-                                *(curPx + 1) + 
-                                *(curPx + 2)) * 0.33333333);
-                        else
-                            pixelbfr[i] = (byte)(
-                                *(curPx + 0) * 0.3 +
-                                *(curPx + 1) * 0.59 +
-                                *(curPx + 2) * 0.11);
-                    }
-                    break;
+            std::size_t i = 0;
+            for (; (i + 4) <= numPx; i += 4)
+            {
+                const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                const __m128i ga = _mm_and_si128(px, maskGA);
+                const __m128i r  = _mm_and_si128(_mm_srli_epi32(px, 16), maskB);
+                const __m128i b  = _mm_slli_epi32(_mm_and_si128(px, maskB), 16);
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(ga, _mm_or_si128(r, b)));
+            }
 
-                case COLOR_MODE::RGBA:
-                    // RGB -> RGBA
+            return i;
+        }
 
-                    ReInitialize(width, height, COLOR_MODE::RGBA);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i * 3;
+        BMPLIB_TARGET("avx2")
+        inline std::size_t SwapRB32_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m256i shuffle = _mm256_setr_epi8(
+                2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
 
-                        pixelbfr[i * 4 + 0] = *(curPx + 0);
-                        pixelbfr[i * 4 + 1] = *(curPx + 1);
-                        pixelbfr[i * 4 + 2] = *(curPx + 2);
-                        pixelbfr[i * 4 + 3] = 0xFF;
-                    }
-                    break;
+            std::size_t i = 0;
+            for (; (i + 8) <= numPx; i += 8)
+            {
+                const __m256i px = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+                _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(px, shuffle));
+            }
 
-                default:
-                    break;
-                }
-#ifndef __linux__
-#pragma endregion
-#endif
-                break;
-            
-            case COLOR_MODE::RGBA:
-#ifndef __linux__
-#pragma region CONVERT_FROM_RGBA
+            return i;
+        }
 #endif
-                switch (convto)
-                {
-                case COLOR_MODE::BW:
-                    // RGBA -> BW
 
-                    ReInitialize(width, height, COLOR_MODE::BW);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i * 4;
+        // Will turn R-G-B into B-G-R and vice versa. src and dst may be the same buffer
+        inline void SwapRB24(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t i = 0;
 
-                        if (isNonColorData)
-                            pixelbfr[i] = (byte)((
-                                *(curPx + 0) + 
-                                *(curPx + 1) +
-                                *(curPx + 2)) * 0.33333333);
-                        else
-                            pixelbfr[i] = (byte)(
-                                *(curPx + 0) * 0.3 +
-                                *(curPx + 1) * 0.59 +
-                                *(curPx + 2) * 0.11);
-                    }
-                    break;
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = SwapRB24_AVX2(src, dst, numPx);
+            else if (GetCpuFeatures().ssse3)
+                i = SwapRB24_SSSE3(src, dst, numPx);
+#endif
 
-                case COLOR_MODE::RGB:
-                    // RGBA -> RGB
+            for (; i < numPx; i++)
+            {
+                const byte r = src[i * 3 + 0];
+                dst[i * 3 + 0] = src[i * 3 + 2];
+                dst[i * 3 + 1] = src[i * 3 + 1];
+                dst[i * 3 + 2] = r;
+            }
 
-                    ReInitialize(width, height, COLOR_MODE::RGB);
-                    for (std::size_t i = 0; i < numPx; i++)
-                    {
-                        curPx = tmp_pxlbfr + i * 4;
+            return;
+        }
 
-                        pixelbfr[i * 3 + 0] = *(curPx + 0);
-                        pixelbfr[i * 3 + 1] = *(curPx + 1);
-                        pixelbfr[i * 3 + 2] = *(curPx + 2);
-                    }
-                    break;
+        // Will turn R-G-B-A into B-G-R-A and vice versa. src and dst may be the same buffer
+        inline void SwapRB32(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t i = 0;
 
-                default:
-                    break;
-                }
-#ifndef __linux__
-#pragma endregion
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = SwapRB32_AVX2(src, dst, numPx);
+            else if (GetCpuFeatures().sse2)
+                i = SwapRB32_SSE2(src, dst, numPx);
 #endif
-                break;
+
+            for (; i < numPx; i++)
+            {
+                const byte r = src[i * 4 + 0];
+                dst[i * 4 + 0] = src[i * 4 + 2];
+                dst[i * 4 + 1] = src[i * 4 + 1];
+                dst[i * 4 + 2] = r;
+                dst[i * 4 + 3] = src[i * 4 + 3];
             }
 
-            delete[] tmp_pxlbfr;
             return;
         }
 
-        byte* GetPixelBuffer() noexcept
+        // Rounding contract of every conversion to BW, scalar or simd alike:
+        //   color data:     v = (9830 * r + 19333 * g + 3605 * b) >> 15   (0.3, 0.59 and 0.11 in 1.15 fixed point, rounded down)
+        //   non-color data: v = (r + g + b) / 3                         (rounded down)
+        struct GrayWeights
         {
-            return pixelbfr;
-        }
+            int r;
+            int g;
+            int b;
+            int shift;
+        };
 
-        const byte* GetPixelBuffer() const noexcept
-        {
-            return pixelbfr;
-        }
+        constexpr GrayWeights grayWeightsColor    = { 9830, 19333, 3605, 15 };
+        constexpr GrayWeights grayWeightsNonColor = { 21846, 21846, 21846, 16 }; // (r + g + b) * 21846 >> 16 is exactly (r + g + b) / 3 for any sum up to 765
 
-        std::size_t GetWidth() const noexcept
+#ifdef BMPLIB_X86_SIMD
+        BMPLIB_TARGET("sse2")
+        // 4 R-G-B-x pixels ==> 4 32-bit gray values
+        inline __m128i Gray4_SSE2(const __m128i& px, const __m128i& weightsRB, const __m128i& weightsG, const __m128i& shift) noexcept
         {
-            return width;
+            const __m128i rb = _mm_and_si128(px, _mm_set1_epi32(0x00FF00FF));
+            const __m128i g  = _mm_and_si128(_mm_srli_epi32(px, 8), _mm_set1_epi32(0xFF));
+            return _mm_srl_epi32(_mm_add_epi32(_mm_madd_epi16(rb, weightsRB), _mm_madd_epi16(g, weightsG)), shift);
         }
 
-        std::size_t GetHeight() const noexcept
+        BMPLIB_TARGET("avx2")
+        // 8 R-G-B-x pixels ==> 8 32-bit gray values
+        inline __m256i Gray8_AVX2(const __m256i& px, const __m256i& weightsRB, const __m256i& weightsG, const __m128i& shift) noexcept
         {
-            return height;
+            const __m256i rb = _mm256_and_si256(px, _mm256_set1_epi32(0x00FF00FF));
+            const __m256i g  = _mm256_and_si256(_mm256_srli_epi32(px, 8), _mm256_set1_epi32(0xFF));
+            return _mm256_srl_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, weightsRB), _mm256_madd_epi16(g, weightsG)), shift);
         }
 
-        COLOR_MODE GetColorMode() const noexcept
+        BMPLIB_TARGET("avx2")
+        // 8 R-G-B pixels (reads 28 bytes) ==> 8 R-G-B-0 pixels
+        inline __m256i LoadRgb8_AVX2(const byte* src) noexcept
         {
-            return colorMode;
-        }
+            const __m256i shuffle = _mm256_setr_epi8(
+                0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
 
-        bool IsInitialized() const noexcept
-        {
-            return isInitialized;
+            return _mm256_shuffle_epi8(_mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+                _mm_loadu_si128((const __m128i*)(src + 12)), 1), shuffle);
         }
 
-        std::size_t CalculatePixelIndex(const std::size_t& x, const std::size_t& y) const
+        BMPLIB_TARGET("sse2")
+        inline std::size_t Rgba32ToGray_SSE2(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
         {
-            if ((x >= width) || (y >= height)) ThrowException("Pixel coordinates out of range!");
+            const __m128i weightsRB = _mm_set1_epi32((weights.b << 16) | weights.r);
+            const __m128i weightsG  = _mm_set1_epi32(weights.g);
+            const __m128i shift     = _mm_cvtsi32_si128(weights.shift);
 
-            return numChannelsPXBF * ((y * width) + x);
-        }
+            std::size_t i = 0;
+            for (; (i + 16) <= numPx; i += 16)
+            {
+                const __m128i v0 = Gray4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 +  0)), weightsRB, weightsG, shift);
+                const __m128i v1 = Gray4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 + 16)), weightsRB, weightsG, shift);
+                const __m128i v2 = Gray4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 + 32)), weightsRB, weightsG, shift);
+                const __m128i v3 = Gray4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 + 48)), weightsRB, weightsG, shift);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+            }
 
-        byte* GetPixel(const std::size_t& x, const std::size_t& y)
-        {
-            return pixelbfr + CalculatePixelIndex(x, y);
+            return i;
         }
 
-        const byte* GetPixel(const std::size_t& x, const std::size_t& y) const
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgba32ToGray_AVX2(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
         {
-            return pixelbfr + CalculatePixelIndex(x, y);
+            const __m256i weightsRB = _mm256_set1_epi32((weights.b << 16) | weights.r);
+            const __m256i weightsG  = _mm256_set1_epi32(weights.g);
+            const __m128i shift     = _mm_cvtsi32_si128(weights.shift);
+            const __m256i unpack    = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); // packs works per 128 bit lane
+
+            std::size_t i = 0;
+            for (; (i + 32) <= numPx; i += 32)
+            {
+                const __m256i v0 = Gray8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 +  0)), weightsRB, weightsG, shift);
+                const __m256i v1 = Gray8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 32)), weightsRB, weightsG, shift);
+                const __m256i v2 = Gray8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 64)), weightsRB, weightsG, shift);
+                const __m256i v3 = Gray8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 96)), weightsRB, weightsG, shift);
+                const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1), _mm256_packs_epi32(v2, v3));
+                _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permutevar8x32_epi32(packed, unpack));
+            }
+
+            return i;
         }
 
-        // Sets a pixels color
-        // If using RGBA, use all
-        // If using RGB, a gets ignored
-        // If using BW, use only r
-        void SetPixel(const std::size_t& x, const std::size_t& y, const byte& r, const byte& g = 0, const byte& b = 0, const byte& a = 0)
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t Rgb24ToGray_SSSE3(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
         {
-            byte* px = GetPixel(x, y);
+            const __m128i weightsRB = _mm_set1_epi32((weights.b << 16) | weights.r);
+            const __m128i weightsG  = _mm_set1_epi32(weights.g);
+            const __m128i shift     = _mm_cvtsi32_si128(weights.shift);
+            const __m128i toRgbx    = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
 
-            switch (colorMode)
+            std::size_t i = 0;
+            for (; (i + 18) <= numPx; i += 16) // The last load reaches 4 bytes into pixel 17
             {
-            case COLOR_MODE::BW:
-                px[0] = r;
-                break;
+                const __m128i v0 = Gray4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 +  0)), toRgbx), weightsRB, weightsG, shift);
+                const __m128i v1 = Gray4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 + 12)), toRgbx), weightsRB, weightsG, shift);
+                const __m128i v2 = Gray4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 + 24)), toRgbx), weightsRB, weightsG, shift);
+                const __m128i v3 = Gray4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 + 36)), toRgbx), weightsRB, weightsG, shift);
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+            }
 
-            case COLOR_MODE::RGB:
-                px[0] = r;
-                px[1] = g;
-                px[2] = b;
-                break;
+            return i;
+        }
 
-            case COLOR_MODE::RGBA:
-                px[0] = r;
-                px[1] = g;
-                px[2] = b;
-                px[3] = a;
-                break;
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgb24ToGray_AVX2(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
+        {
+            const __m256i weightsRB = _mm256_set1_epi32((weights.b << 16) | weights.r);
+            const __m256i weightsG  = _mm256_set1_epi32(weights.g);
+            const __m128i shift     = _mm_cvtsi32_si128(weights.shift);
+            const __m256i unpack    = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); // packs works per 128 bit lane
+
+            std::size_t i = 0;
+            for (; (i + 34) <= numPx; i += 32) // The last load reaches 4 bytes into pixel 33
+            {
+                const __m256i v0 = Gray8_AVX2(LoadRgb8_AVX2(src + i * 3 +  0), weightsRB, weightsG, shift);
+                const __m256i v1 = Gray8_AVX2(LoadRgb8_AVX2(src + i * 3 + 24), weightsRB, weightsG, shift);
+                const __m256i v2 = Gray8_AVX2(LoadRgb8_AVX2(src + i * 3 + 48), weightsRB, weightsG, shift);
+                const __m256i v3 = Gray8_AVX2(LoadRgb8_AVX2(src + i * 3 + 72), weightsRB, weightsG, shift);
+                const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1), _mm256_packs_epi32(v2, v3));
+                _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permutevar8x32_epi32(packed, unpack));
             }
 
-            return;
+            return i;
         }
 
-        // Will write a bmp image
-        bool Write(const std::string& filename)
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t Rgba32ToRgb24_SSSE3(const byte* src, byte* dst, const std::size_t& numPx) noexcept
         {
-            if (!isInitialized)
-                return false;
+            const __m128i dropA = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
 
-            std::size_t paddingSize = (4 - ((width * numChannelsFile) % 4)) % 4; // number of padding bytes per scanline
-            byte paddingData[4] = { 0x69,0x69,0x69,0x69 }; // dummy-data for padding
-
-            bytestream data;
-            data
-                // BMP Header
-                << ToBytes(byte2(0x4D42)) // signature
-                << ToBytes(byte4(0x36 + sizeofPxlbfr + paddingSize * height)) // size of the bmp file (all bytes)
-                << ToBytes(byte2(0))      // unused
-                << ToBytes(byte2(0))      // unused
-                << ToBytes(byte4(0x36))   // Offset where the pixel array begins (size of both headers)
-
-                // DIB Header
-                << ToBytes(byte4(0x28))   // Number of bytes in DIB header (without this field)
-                << ToBytes(byte4(width))  // width
-                << ToBytes(byte4(height)) // height
-                << ToBytes(byte2(1))      // number of planes used
-                << ToBytes(byte2(numChannelsFile * 8)) // bit-depth
-                << ToBytes(byte4(0))      // no compression
-                << ToBytes(byte4(sizeofPxlbfr + paddingSize * height)) // Size of raw bitmap data (including padding)
-                << ToBytes(byte4(0xB13))  // print resolution pixels/meter X
-                << ToBytes(byte4(0xB13))  // print resolution pixels/meter Y
-                << ToBytes(byte4(0))      // 0 colors in the color palette
-                << ToBytes(byte4(0));     // 0 means all colors are important
-
-            // Dumbass unusual pixel order of bmp made me do this...
-            for (long long y = height - 1; y >= 0; y--)
+            std::size_t i = 0;
+            for (; (i + 6) <= numPx; i += 4) // Every store spills 4 bytes into the next pixels, which will be overwritten right after
             {
-                for (std::size_t x = 0; x < width; x++)
-                {
-                    std::size_t idx = CalculatePixelIndex(x, (std::size_t)y); // No precision lost here. I just need a type that can get as large as std::size_t but is also signed (because for y >= 0)
+                const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(px, dropA));
+            }
 
-                    switch (colorMode)
-                    {
-                    case COLOR_MODE::BW:
-                        // pixelbfr ==> R-G-B ==> B-G-R ==> bmp format
-                        data.write((pixelbfr + idx), 1); // B
-                        data.write((pixelbfr + idx), 1); // G
-                        data.write((pixelbfr + idx), 1); // R
+            return i;
+        }
 
-                        break;
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgba32ToRgb24_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m256i dropA = _mm256_setr_epi8(
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
 
-                    case COLOR_MODE::RGB:
-                        // pixelbfr ==> R-G-B ==> B-G-R ==> bmp format
-                        data.write((pixelbfr + idx + 2), 1); // B
-                        data.write((pixelbfr + idx + 1), 1); // G
-                        data.write((pixelbfr + idx + 0), 1); // R
+            std::size_t i = 0;
+            for (; (i + 8) <= numPx; i += 8)
+            {
+                const __m256i px = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+                const __m256i rgb = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, dropA), pack);
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm256_castsi256_si128(rgb));
+                _mm_storel_epi64((__m128i*)(dst + i * 3 + 16), _mm256_extracti128_si256(rgb, 1));
+            }
 
-                        break;
+            return i;
+        }
 
-                    case COLOR_MODE::RGBA:
-                        // pixelbfr ==> R-G-B-A ==> B-G-R-A ==> bmp format
-                        data.write((pixelbfr + idx + 2), 1); // B
-                        data.write((pixelbfr + idx + 1), 1); // G
-                        data.write((pixelbfr + idx + 0), 1); // R
-                        data.write((pixelbfr + idx + 3), 1); // A
+        // The growing kernels below work on pixels [0, numPx) back to front, so that they can work in place
 
-                        break;
-                    }
-                }
+        BMPLIB_TARGET("ssse3")
+        inline void GrayToRgb24_SSSE3(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m128i spread0 = _mm_setr_epi8( 0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5);
+            const __m128i spread1 = _mm_setr_epi8( 5,  5,  6,  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10, 10);
+            const __m128i spread2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
 
-                if ((colorMode == COLOR_MODE::BW) || (colorMode == COLOR_MODE::RGB))
-                    if (paddingSize > 0)
-                        data.write(paddingData, paddingSize);
+            for (std::size_t i = numPx; i >= 16;)
+            {
+                i -= 16;
+                const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                _mm_storeu_si128((__m128i*)(dst + i * 3 +  0), _mm_shuffle_epi8(v, spread0));
+                _mm_storeu_si128((__m128i*)(dst + i * 3 + 16), _mm_shuffle_epi8(v, spread1));
+                _mm_storeu_si128((__m128i*)(dst + i * 3 + 32), _mm_shuffle_epi8(v, spread2));
             }
 
+            return;
+        }
 
+        BMPLIB_TARGET("sse2")
+        inline void GrayToRgba32_SSE2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+            for (std::size_t i = numPx; i >= 16;)
+            {
+                i -= 16;
+                const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                const __m128i lo = _mm_unpacklo_epi8(v, v);
+                const __m128i hi = _mm_unpackhi_epi8(v, v);
+                _mm_storeu_si128((__m128i*)(dst + i * 4 +  0), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+                _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+            }
+
+            return;
+        }
+
+        BMPLIB_TARGET("ssse3")
+        // Every load reaches 4 bytes past its 4 pixels, so the caller has to leave 2 pixels of headroom behind numPx
+        inline void Rgb24ToRgba32_SSSE3(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m128i toRgbx = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+            for (std::size_t i = numPx; i >= 4;)
+            {
+                i -= 4;
+                const __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(px, toRgbx), alpha));
+            }
+
+            return;
+        }
+
+        BMPLIB_TARGET("avx2")
+        // Every load reaches 4 bytes past its 8 pixels, so the caller has to leave 2 pixels of headroom behind numPx
+        inline void Rgb24ToRgba32_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+
+            for (std::size_t i = numPx; i >= 8;)
+            {
+                i -= 8;
+                _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_or_si256(LoadRgb8_AVX2(src + i * 3), alpha));
+            }
+
+            return;
+        }
+#endif
+
+        // Will turn R-G-B into V, see GrayWeights. src and dst may be the same buffer
+        inline void Rgb24ToGray(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgb24ToGray_AVX2(src, dst, numPx, weights);
+            else if (GetCpuFeatures().ssse3)
+                i = Rgb24ToGray_SSSE3(src, dst, numPx, weights);
+#endif
+
+            for (; i < numPx; i++)
+                dst[i] = (byte)((src[i * 3 + 0] * weights.r + src[i * 3 + 1] * weights.g + src[i * 3 + 2] * weights.b) >> weights.shift);
+
+            return;
+        }
+
+        // Will turn R-G-B-A into V, see GrayWeights. src and dst may be the same buffer
+        inline void Rgba32ToGray(const byte* src, byte* dst, const std::size_t& numPx, const GrayWeights& weights) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgba32ToGray_AVX2(src, dst, numPx, weights);
+            else if (GetCpuFeatures().sse2)
+                i = Rgba32ToGray_SSE2(src, dst, numPx, weights);
+#endif
+
+            for (; i < numPx; i++)
+                dst[i] = (byte)((src[i * 4 + 0] * weights.r + src[i * 4 + 1] * weights.g + src[i * 4 + 2] * weights.b) >> weights.shift);
+
+            return;
+        }
+
+        // Will turn R-G-B-A into R-G-B. src and dst may be the same buffer
+        inline void Rgba32ToRgb24(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgba32ToRgb24_AVX2(src, dst, numPx);
+            else if (GetCpuFeatures().ssse3)
+                i = Rgba32ToRgb24_SSSE3(src, dst, numPx);
+#endif
+
+            for (; i < numPx; i++)
+            {
+                dst[i * 3 + 0] = src[i * 4 + 0];
+                dst[i * 3 + 1] = src[i * 4 + 1];
+                dst[i * 3 + 2] = src[i * 4 + 2];
+            }
+
+            return;
+        }
+
+        // Will turn V into V-V-V. src and dst may be the same buffer
+        inline void GrayToRgb24(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t numSimdPx = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().ssse3)
+                numSimdPx = numPx - numPx % 16;
+#endif
+
+            // Back to front, so we never overwrite pixels we still need
+            for (std::size_t i = numPx; i > numSimdPx;)
+            {
+                i--;
+                dst[i * 3 + 0] = src[i];
+                dst[i * 3 + 1] = src[i];
+                dst[i * 3 + 2] = src[i];
+            }
+
+#ifdef BMPLIB_X86_SIMD
+            if (numSimdPx)
+                GrayToRgb24_SSSE3(src, dst, numSimdPx);
+#endif
+
+            return;
+        }
+
+        // Will turn V into V-V-V-FF. src and dst may be the same buffer
+        inline void GrayToRgba32(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t numSimdPx = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().sse2)
+                numSimdPx = numPx - numPx % 16;
+#endif
+
+            // Back to front, so we never overwrite pixels we still need
+            for (std::size_t i = numPx; i > numSimdPx;)
+            {
+                i--;
+                dst[i * 4 + 0] = src[i];
+                dst[i * 4 + 1] = src[i];
+                dst[i * 4 + 2] = src[i];
+                dst[i * 4 + 3] = 0xFF;
+            }
+
+#ifdef BMPLIB_X86_SIMD
+            if (numSimdPx)
+                GrayToRgba32_SSE2(src, dst, numSimdPx);
+#endif
+
+            return;
+        }
+
+        // Will turn R-G-B into R-G-B-FF. src and dst may be the same buffer
+        inline void Rgb24ToRgba32(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            std::size_t numSimdPx = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            const std::size_t chunk = GetCpuFeatures().avx2 ? 8 : GetCpuFeatures().ssse3 ? 4 : 0;
+            if ((chunk) && (numPx >= 2))
+                numSimdPx = (numPx - 2) - (numPx - 2) % chunk; // Leave headroom for the simd loads
+#endif
+
+            // Back to front, so we never overwrite pixels we still need
+            for (std::size_t i = numPx; i > numSimdPx;)
+            {
+                i--;
+                dst[i * 4 + 3] = 0xFF;
+                dst[i * 4 + 2] = src[i * 3 + 2];
+                dst[i * 4 + 1] = src[i * 3 + 1];
+                dst[i * 4 + 0] = src[i * 3 + 0];
+            }
+
+#ifdef BMPLIB_X86_SIMD
+            if ((numSimdPx) && (GetCpuFeatures().avx2))
+                Rgb24ToRgba32_AVX2(src, dst, numSimdPx);
+            else if (numSimdPx)
+                Rgb24ToRgba32_SSSE3(src, dst, numSimdPx);
+#endif
+
+            return;
+        }
+
+        // Will look up every palette index of src in palette (256 R-G-B entries), and write R-G-B to dst
+        inline void PaletteToRgb24(const byte* src, byte* dst, const std::size_t& numPx, const byte* palette) noexcept
+        {
+            for (std::size_t i = 0; i < numPx; i++)
+            {
+                const byte* entry = palette + src[i] * 3;
+                dst[i * 3 + 0] = entry[0];
+                dst[i * 3 + 1] = entry[1];
+                dst[i * 3 + 2] = entry[2];
+            }
+
+            return;
+        }
+
+        // How R-G-B gets packed into 16 bits. Blue always takes the lowest 5 bits, green the bits right above, and red the ones above that.
+        // Going down, every channel gets scaled to the nearest of its levels: q = (v * max + d) / 255, with d = 127 to round, or a dither threshold.
+        // Going up, the top bits of every channel get repeated into the low bits, so 0 stays 0 and the maximum becomes 255. Both ways round trip
+        struct Rgb16Layout
+        {
+            int redShift;
+            int greenBits;
+        };
+
+        constexpr Rgb16Layout rgb565 = { 11, 6 };
+        constexpr Rgb16Layout rgb555 = { 10, 5 }; // top bit unused
+
+#ifdef BMPLIB_X86_SIMD
+        BMPLIB_TARGET("sse2")
+        // 2 R-G-B-x pixels, one channel per 16 bit ==> (v * max + d) / 255 per channel. (x + 1 + (x >> 8)) >> 8 is exactly x / 255 for any x below 65535
+        inline __m128i Quantize16_SSE2(const __m128i& v, const __m128i& scale, const __m128i& threshold) noexcept
+        {
+            const __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, scale), threshold);
+            return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+        }
+
+        BMPLIB_TARGET("sse2")
+        // 4 R-G-B-x pixels ==> 4 32-bit packed pixels. scale holds max per channel, and the thresholds d for the first and last 2 pixels, all as 16 bit
+        inline __m128i Pack16x4_SSE2(const __m128i& px, const __m128i& redShift, const __m128i& scale, const __m128i& thresholdLo, const __m128i& thresholdHi) noexcept
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i q = _mm_packus_epi16(
+                Quantize16_SSE2(_mm_unpacklo_epi8(px, zero), scale, thresholdLo),
+                Quantize16_SSE2(_mm_unpackhi_epi8(px, zero), scale, thresholdHi));
+
+            const __m128i mask = _mm_set1_epi32(0xFF);
+            const __m128i r = _mm_sll_epi32(_mm_and_si128(q, mask), redShift);
+            const __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(q, 8), mask), 5);
+            const __m128i b = _mm_srli_epi32(q, 16);
+            return _mm_or_si128(r, _mm_or_si128(g, b));
+        }
+
+        BMPLIB_TARGET("sse2")
+        // 2x4 32-bit values below 0x10000 ==> 8 16-bit values. There is no unsigned 32 to 16 bit pack before sse4.1, so this goes through the signed one
+        inline __m128i PackU32ToU16_SSE2(const __m128i& a, const __m128i& b) noexcept
+        {
+            const __m128i bias32 = _mm_set1_epi32(0x8000);
+            const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+            return _mm_add_epi16(_mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32)), bias16);
+        }
+
+        BMPLIB_TARGET("avx2")
+        // See Quantize16_SSE2
+        inline __m256i Quantize16_AVX2(const __m256i& v, const __m256i& scale, const __m256i& threshold) noexcept
+        {
+            const __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(v, scale), threshold);
+            return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+        }
+
+        BMPLIB_TARGET("avx2")
+        // 8 R-G-B-x pixels ==> 8 32-bit packed pixels. Works per 128 bit lane, just like Pack16x4_SSE2
+        inline __m256i Pack16x8_AVX2(const __m256i& px, const __m128i& redShift, const __m256i& scale, const __m256i& thresholdLo, const __m256i& thresholdHi) noexcept
+        {
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i q = _mm256_packus_epi16(
+                Quantize16_AVX2(_mm256_unpacklo_epi8(px, zero), scale, thresholdLo),
+                Quantize16_AVX2(_mm256_unpackhi_epi8(px, zero), scale, thresholdHi));
+
+            const __m256i mask = _mm256_set1_epi32(0xFF);
+            const __m256i r = _mm256_sll_epi32(_mm256_and_si256(q, mask), redShift);
+            const __m256i g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(q, 8), mask), 5);
+            const __m256i b = _mm256_srli_epi32(q, 16);
+            return _mm256_or_si256(r, _mm256_or_si256(g, b));
+        }
+
+        BMPLIB_TARGET("sse2")
+        // 4 32-bit packed pixels ==> 4 R-G-B-0 pixels. The shifts are 8 - greenBits and 2 * greenBits - 8
+        inline __m128i Unpack16x4_SSE2(const __m128i& v, const __m128i& redShift, const __m128i& greenMask, const __m128i& greenUp, const __m128i& greenDown) noexcept
+        {
+            const __m128i mask5 = _mm_set1_epi32(0x1F);
+            const __m128i r = _mm_and_si128(_mm_srl_epi32(v, redShift), mask5);
+            const __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), greenMask);
+            const __m128i b = _mm_and_si128(v, mask5);
+            const __m128i r8 = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+            const __m128i g8 = _mm_or_si128(_mm_sll_epi32(g, greenUp), _mm_srl_epi32(g, greenDown));
+            const __m128i b8 = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+            return _mm_or_si128(r8, _mm_or_si128(_mm_slli_epi32(g8, 8), _mm_slli_epi32(b8, 16)));
+        }
+
+        BMPLIB_TARGET("avx2")
+        // 8 32-bit packed pixels ==> 8 R-G-B-0 pixels. The shifts are 8 - greenBits and 2 * greenBits - 8
+        inline __m256i Unpack16x8_AVX2(const __m256i& v, const __m128i& redShift, const __m256i& greenMask, const __m128i& greenUp, const __m128i& greenDown) noexcept
+        {
+            const __m256i mask5 = _mm256_set1_epi32(0x1F);
+            const __m256i r = _mm256_and_si256(_mm256_srl_epi32(v, redShift), mask5);
+            const __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5), greenMask);
+            const __m256i b = _mm256_and_si256(v, mask5);
+            const __m256i r8 = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+            const __m256i g8 = _mm256_or_si256(_mm256_sll_epi32(g, greenUp), _mm256_srl_epi32(g, greenDown));
+            const __m256i b8 = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+            return _mm256_or_si256(r8, _mm256_or_si256(_mm256_slli_epi32(g8, 8), _mm256_slli_epi32(b8, 16)));
+        }
+
+        BMPLIB_TARGET("sse2")
+        inline std::size_t Rgba32ToRgb16_SSE2(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            const __m128i redShift    = _mm_cvtsi32_si128(layout.redShift);
+            const __m128i scale       = _mm_setr_epi16(31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0);
+            const __m128i threshold   = _mm_loadu_si128((const __m128i*)dither);
+            const __m128i thresholdLo = _mm_unpacklo_epi8(threshold, _mm_setzero_si128());
+            const __m128i thresholdHi = _mm_unpackhi_epi8(threshold, _mm_setzero_si128());
+
+            std::size_t i = 0;
+            for (; (i + 8) <= numPx; i += 8)
+            {
+                const __m128i v0 = Pack16x4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 +  0)), redShift, scale, thresholdLo, thresholdHi);
+                const __m128i v1 = Pack16x4_SSE2(_mm_loadu_si128((const __m128i*)(src + i * 4 + 16)), redShift, scale, thresholdLo, thresholdHi);
+                _mm_storeu_si128((__m128i*)(dst + i * 2), PackU32ToU16_SSE2(v0, v1));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t Rgb24ToRgb16_SSSE3(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            const __m128i redShift    = _mm_cvtsi32_si128(layout.redShift);
+            const __m128i scale       = _mm_setr_epi16(31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0);
+            const __m128i threshold   = _mm_loadu_si128((const __m128i*)dither);
+            const __m128i thresholdLo = _mm_unpacklo_epi8(threshold, _mm_setzero_si128());
+            const __m128i thresholdHi = _mm_unpackhi_epi8(threshold, _mm_setzero_si128());
+            const __m128i toRgbx      = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+            std::size_t i = 0;
+            for (; (i + 10) <= numPx; i += 8) // The last load reaches 4 bytes into pixel 9
+            {
+                const __m128i v0 = Pack16x4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 +  0)), toRgbx), redShift, scale, thresholdLo, thresholdHi);
+                const __m128i v1 = Pack16x4_SSE2(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3 + 12)), toRgbx), redShift, scale, thresholdLo, thresholdHi);
+                _mm_storeu_si128((__m128i*)(dst + i * 2), PackU32ToU16_SSE2(v0, v1));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgba32ToRgb16_AVX2(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            const __m128i redShift    = _mm_cvtsi32_si128(layout.redShift);
+            const __m256i scale       = _mm256_setr_epi16(
+                31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0,
+                31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0);
+            const __m128i threshold   = _mm_loadu_si128((const __m128i*)dither);
+            const __m256i thresholdLo = _mm256_broadcastsi128_si256(_mm_unpacklo_epi8(threshold, _mm_setzero_si128()));
+            const __m256i thresholdHi = _mm256_broadcastsi128_si256(_mm_unpackhi_epi8(threshold, _mm_setzero_si128()));
+
+            std::size_t i = 0;
+            for (; (i + 16) <= numPx; i += 16)
+            {
+                const __m256i v0 = Pack16x8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 +  0)), redShift, scale, thresholdLo, thresholdHi);
+                const __m256i v1 = Pack16x8_AVX2(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 32)), redShift, scale, thresholdLo, thresholdHi);
+                _mm256_storeu_si256((__m256i*)(dst + i * 2), _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1), 0xD8)); // packus works per 128 bit lane
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgb24ToRgb16_AVX2(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            const __m128i redShift    = _mm_cvtsi32_si128(layout.redShift);
+            const __m256i scale       = _mm256_setr_epi16(
+                31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0,
+                31, (short)((1 << layout.greenBits) - 1), 31, 0, 31, (short)((1 << layout.greenBits) - 1), 31, 0);
+            const __m128i threshold   = _mm_loadu_si128((const __m128i*)dither);
+            const __m256i thresholdLo = _mm256_broadcastsi128_si256(_mm_unpacklo_epi8(threshold, _mm_setzero_si128()));
+            const __m256i thresholdHi = _mm256_broadcastsi128_si256(_mm_unpackhi_epi8(threshold, _mm_setzero_si128()));
+
+            std::size_t i = 0;
+            for (; (i + 18) <= numPx; i += 16) // The last load reaches 4 bytes into pixel 17
+            {
+                const __m256i v0 = Pack16x8_AVX2(LoadRgb8_AVX2(src + i * 3 +  0), redShift, scale, thresholdLo, thresholdHi);
+                const __m256i v1 = Pack16x8_AVX2(LoadRgb8_AVX2(src + i * 3 + 24), redShift, scale, thresholdLo, thresholdHi);
+                _mm256_storeu_si256((__m256i*)(dst + i * 2), _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1), 0xD8)); // packus works per 128 bit lane
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t Rgb16ToRgb24_SSSE3(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout) noexcept
+        {
+            const __m128i redShift  = _mm_cvtsi32_si128(layout.redShift);
+            const __m128i greenMask = _mm_set1_epi32((1 << layout.greenBits) - 1);
+            const __m128i greenUp   = _mm_cvtsi32_si128(8 - layout.greenBits);
+            const __m128i greenDown = _mm_cvtsi32_si128(2 * layout.greenBits - 8);
+            const __m128i dropX     = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+            std::size_t i = 0;
+            for (; (i + 10) <= numPx; i += 8) // Every store spills 4 bytes into the next pixels, which will be overwritten right after
+            {
+                const __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                const __m128i px0 = Unpack16x4_SSE2(_mm_unpacklo_epi16(v, _mm_setzero_si128()), redShift, greenMask, greenUp, greenDown);
+                const __m128i px1 = Unpack16x4_SSE2(_mm_unpackhi_epi16(v, _mm_setzero_si128()), redShift, greenMask, greenUp, greenDown);
+                _mm_storeu_si128((__m128i*)(dst + i * 3 +  0), _mm_shuffle_epi8(px0, dropX));
+                _mm_storeu_si128((__m128i*)(dst + i * 3 + 12), _mm_shuffle_epi8(px1, dropX));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t Rgb16ToRgb24_AVX2(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout) noexcept
+        {
+            const __m128i redShift  = _mm_cvtsi32_si128(layout.redShift);
+            const __m256i greenMask = _mm256_set1_epi32((1 << layout.greenBits) - 1);
+            const __m128i greenUp   = _mm_cvtsi32_si128(8 - layout.greenBits);
+            const __m128i greenDown = _mm_cvtsi32_si128(2 * layout.greenBits - 8);
+            const __m256i dropX = _mm256_setr_epi8(
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+            std::size_t i = 0;
+            for (; (i + 8) <= numPx; i += 8)
+            {
+                const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i * 2)));
+                const __m256i px = Unpack16x8_AVX2(v, redShift, greenMask, greenUp, greenDown);
+                const __m256i rgb = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, dropX), pack);
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm256_castsi256_si128(rgb));
+                _mm_storel_epi64((__m128i*)(dst + i * 3 + 16), _mm256_extracti128_si256(rgb, 1));
+            }
+
+            return i;
+        }
+#endif
+
+        // Will pack one pixel, with d = threshold per channel, see Rgb16Layout
+        inline void PackRgb16(const byte* px, byte* dst, const Rgb16Layout& layout, const byte* threshold) noexcept
+        {
+            const int greenMax = (1 << layout.greenBits) - 1;
+            const int r = (px[0] * 31 + threshold[0]) / 255;
+            const int g = (px[1] * greenMax + threshold[1]) / 255;
+            const int b = (px[2] * 31 + threshold[2]) / 255;
+            const int v = (r << layout.redShift) | (g << 5) | b;
+            dst[0] = (byte)(v & 0xFF);
+            dst[1] = (byte)(v >> 8);
+            return;
+        }
+
+        // Will turn R-G-B into 16 bit R-G-B (see Rgb16Layout).
+        // dither holds the thresholds d (R-G-B-unused) of 4 pixels. It repeats every 4 pixels, starting at src. All 127 is plain rounding
+        inline void Rgb24ToRgb16(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgb24ToRgb16_AVX2(src, dst, numPx, layout, dither);
+            else if (GetCpuFeatures().ssse3)
+                i = Rgb24ToRgb16_SSSE3(src, dst, numPx, layout, dither);
+#endif
+
+            for (; i < numPx; i++)
+                PackRgb16(src + i * 3, dst + i * 2, layout, dither + (i % 4) * 4);
+
+            return;
+        }
+
+        // Will turn R-G-B-A into 16 bit R-G-B (see Rgb16Layout), dropping alpha. dither works like in Rgb24ToRgb16
+        inline void Rgba32ToRgb16(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout, const byte* dither) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgba32ToRgb16_AVX2(src, dst, numPx, layout, dither);
+            else if (GetCpuFeatures().sse2)
+                i = Rgba32ToRgb16_SSE2(src, dst, numPx, layout, dither);
+#endif
+
+            for (; i < numPx; i++)
+                PackRgb16(src + i * 4, dst + i * 2, layout, dither + (i % 4) * 4);
+
+            return;
+        }
+
+        // Will turn 16 bit R-G-B (see Rgb16Layout) into R-G-B
+        inline void Rgb16ToRgb24(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = Rgb16ToRgb24_AVX2(src, dst, numPx, layout);
+            else if (GetCpuFeatures().ssse3)
+                i = Rgb16ToRgb24_SSSE3(src, dst, numPx, layout);
+#endif
+
+            const int greenMask = (1 << layout.greenBits) - 1;
+            for (; i < numPx; i++)
+            {
+                const int v = src[i * 2] | (src[i * 2 + 1] << 8);
+                const int r = (v >> layout.redShift) & 0x1F;
+                const int g = (v >> 5) & greenMask;
+                const int b = v & 0x1F;
+                dst[i * 3 + 0] = (byte)((r << 3) | (r >> 2));
+                dst[i * 3 + 1] = (byte)((g << (8 - layout.greenBits)) | (g >> (2 * layout.greenBits - 8)));
+                dst[i * 3 + 2] = (byte)((b << 3) | (b >> 2));
+            }
+
+            return;
+        }
+
+#ifdef BMPLIB_X86_SIMD
+        BMPLIB_TARGET("sse2")
+        inline std::size_t AccumulateRow_SSE2(const byte* src, byte2* sums, const std::size_t& size) noexcept
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            std::size_t i = 0;
+            for (; (i + 16) <= size; i += 16)
+            {
+                const __m128i values = _mm_loadu_si128((const __m128i*)(src + i));
+                const __m128i lo = _mm_loadu_si128((const __m128i*)(sums + i));
+                const __m128i hi = _mm_loadu_si128((const __m128i*)(sums + i + 8));
+                _mm_storeu_si128((__m128i*)(sums + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(values, zero)));
+                _mm_storeu_si128((__m128i*)(sums + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(values, zero)));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t AccumulateRow_AVX2(const byte* src, byte2* sums, const std::size_t& size) noexcept
+        {
+            std::size_t i = 0;
+            for (; (i + 32) <= size; i += 32)
+            {
+                const __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+                const __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i + 16)));
+                _mm256_storeu_si256((__m256i*)(sums + i), _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + i)), lo));
+                _mm256_storeu_si256((__m256i*)(sums + i + 16), _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + i + 16)), hi));
+            }
+
+            return i;
+        }
+#endif
+
+        // Will add size bytes onto size 16 bit sums, one by one
+        inline void AccumulateRow(const byte* src, byte2* sums, const std::size_t& size) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = AccumulateRow_AVX2(src, sums, size);
+            else if (GetCpuFeatures().sse2)
+                i = AccumulateRow_SSE2(src, sums, size);
+#endif
+
+            for (; i < size; i++)
+                sums[i] += src[i];
+
+            return;
+        }
+
+#ifdef BMPLIB_X86_SIMD
+        BMPLIB_TARGET("sse2")
+        inline std::size_t FillPixels_SSE2(byte* dst, const std::size_t& numPx, const byte* px, const std::size_t& numChannels) noexcept
+        {
+            // 16 pixels take up numChannels whole registers, whatever the pixel size
+            byte pattern[64];
+            for (std::size_t i = 0; i < 16; i++)
+                memcpy(pattern + i * numChannels, px, numChannels);
+
+            __m128i registers[4];
+            for (std::size_t r = 0; r < numChannels; r++)
+                registers[r] = _mm_loadu_si128((const __m128i*)(pattern + r * 16));
+
+            std::size_t i = 0;
+            for (; (i + 16) <= numPx; i += 16)
+                for (std::size_t r = 0; r < numChannels; r++)
+                    _mm_storeu_si128((__m128i*)(dst + i * numChannels + r * 16), registers[r]);
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t FillPixels_AVX2(byte* dst, const std::size_t& numPx, const byte* px, const std::size_t& numChannels) noexcept
+        {
+            // Same, with 32 pixels
+            byte pattern[128];
+            for (std::size_t i = 0; i < 32; i++)
+                memcpy(pattern + i * numChannels, px, numChannels);
+
+            __m256i registers[4];
+            for (std::size_t r = 0; r < numChannels; r++)
+                registers[r] = _mm256_loadu_si256((const __m256i*)(pattern + r * 32));
+
+            std::size_t i = 0;
+            for (; (i + 32) <= numPx; i += 32)
+                for (std::size_t r = 0; r < numChannels; r++)
+                    _mm256_storeu_si256((__m256i*)(dst + i * numChannels + r * 32), registers[r]);
+
+            return i;
+        }
+
+        BMPLIB_TARGET("ssse3")
+        inline std::size_t MirrorPixels24_SSSE3(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            // 5 pixels per register, loaded from one byte before them, so nothing past the end of src gets touched.
+            // The 16th byte stored lands on the next pixel, which gets written properly later on
+            const __m128i reverse = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0);
+
+            std::size_t i = 0;
+            for (; (i + 6) <= numPx; i += 5)
+            {
+                const __m128i px = _mm_loadu_si128((const __m128i*)(src + (numPx - i - 5) * 3 - 1));
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(px, reverse));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t MirrorPixels8_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            // Reverse the bytes within both lanes, then swap the lanes
+            const __m256i reverse = _mm256_setr_epi8(
+                15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+            std::size_t i = 0;
+            for (; (i + 32) <= numPx; i += 32)
+            {
+                const __m256i px = _mm256_loadu_si256((const __m256i*)(src + numPx - i - 32));
+                _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(_mm256_shuffle_epi8(px, reverse), 0x4E));
+            }
+
+            return i;
+        }
+
+        BMPLIB_TARGET("avx2")
+        inline std::size_t MirrorPixels32_AVX2(const byte* src, byte* dst, const std::size_t& numPx) noexcept
+        {
+            const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+            std::size_t i = 0;
+            for (; (i + 8) <= numPx; i += 8)
+            {
+                const __m256i px = _mm256_loadu_si256((const __m256i*)(src + (numPx - i - 8) * 4));
+                _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_permutevar8x32_epi32(px, reverse));
+            }
+
+            return i;
+        }
+#endif
+
+        // Will set numPx pixels of numChannels (1, 3 or 4) channels to px
+        inline void FillPixels(byte* dst, const std::size_t& numPx, const byte* px, const std::size_t& numChannels) noexcept
+        {
+            if (numChannels == 1)
+            {
+                memset(dst, px[0], numPx);
+                return;
+            }
+
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if (GetCpuFeatures().avx2)
+                i = FillPixels_AVX2(dst, numPx, px, numChannels);
+            else if (GetCpuFeatures().sse2)
+                i = FillPixels_SSE2(dst, numPx, px, numChannels);
+#endif
+
+            for (; i < numPx; i++)
+                for (std::size_t c = 0; c < numChannels; c++)
+                    dst[i * numChannels + c] = px[c];
+
+            return;
+        }
+
+        template <std::size_t numChannels>
+        inline void MirrorPixels(const byte* src, byte* dst, std::size_t i, const std::size_t& numPx) noexcept
+        {
+            for (; i < numPx; i++)
+                memcpy(dst + i * numChannels, src + (numPx - i - 1) * numChannels, numChannels);
+
+            return;
+        }
+
+        // Will copy numPx pixels of numChannels (1, 3 or 4) channels from src to dst, the last one first. src and dst must not overlap
+        inline void MirrorPixels(const byte* src, byte* dst, const std::size_t& numPx, const std::size_t& numChannels) noexcept
+        {
+            std::size_t i = 0;
+
+#ifdef BMPLIB_X86_SIMD
+            if ((numChannels == 1) && (GetCpuFeatures().avx2))
+                i = MirrorPixels8_AVX2(src, dst, numPx);
+            else if ((numChannels == 3) && (GetCpuFeatures().ssse3))
+                i = MirrorPixels24_SSSE3(src, dst, numPx);
+            else if ((numChannels == 4) && (GetCpuFeatures().avx2))
+                i = MirrorPixels32_AVX2(src, dst, numPx);
+#endif
+
+            switch (numChannels)
+            {
+            case 1:
+                MirrorPixels<1>(src, dst, i, numPx);
+                break;
+            case 3:
+                MirrorPixels<3>(src, dst, i, numPx);
+                break;
+            default:
+                MirrorPixels<4>(src, dst, i, numPx);
+                break;
+            }
+
+            return;
+        }
+    }
+
+    // Where a BMP gets the memory for its pixel buffer from. Derive from this to plug in your own allocator.
+    // BMPs without an allocator just use malloc.
+    class PixelAllocator
+    {
+    public:
+        virtual ~PixelAllocator() = default;
+
+        // Will return size bytes of memory, or nullptr if there isn't enough
+        virtual byte* Allocate(const std::size_t& size) = 0;
+
+        // Will take back memory that came from Allocate() or Reallocate(). size is the size it was requested with
+        virtual void Deallocate(byte* ptr, const std::size_t& size) noexcept = 0;
+
+        // Will resize an allocation, keeping as much of its contents as fits.
+        // Returns nullptr, and leaves ptr untouched, if there isn't enough memory
+        virtual byte* Reallocate(byte* ptr, const std::size_t& oldSize, const std::size_t& newSize)
+        {
+            byte* resized = Allocate(newSize);
+            if (!resized)
+                return nullptr;
+
+            memcpy(resized, ptr, oldSize < newSize ? oldSize : newSize);
+            Deallocate(ptr, oldSize);
+            return resized;
+        }
+    };
+
+    // Plain malloc/realloc/free. This is what BMPs without an allocator do anyway
+    class MallocAllocator : public PixelAllocator
+    {
+    public:
+        byte* Allocate(const std::size_t& size) override
+        {
+            return (byte*)malloc(size);
+        }
+
+        void Deallocate(byte* ptr, const std::size_t&) noexcept override
+        {
+            free(ptr);
+            return;
+        }
+
+        byte* Reallocate(byte* ptr, const std::size_t&, const std::size_t& newSize) override
+        {
+            return (byte*)realloc(ptr, newSize);
+        }
+    };
+
+    // Hands out memory aligned to a given power of two, 64 bytes (a cache line) by default.
+    // With useHugePages, allocations of 2 MiB and more get aligned to 2 MiB and marked for transparent huge pages (linux only),
+    // which saves a lot of page faults on large images.
+    class AlignedAllocator : public PixelAllocator
+    {
+    public:
+        explicit AlignedAllocator(const std::size_t& alignment = 64, const bool useHugePages = false) noexcept
+            : alignment{alignment}, useHugePages{useHugePages}
+        {
+            return;
+        }
+
+        byte* Allocate(const std::size_t& size) override
+        {
+            std::size_t align = alignment;
+            if ((useHugePages) && (size >= hugePageSize) && (align < hugePageSize))
+                align = hugePageSize;
+
+#ifdef _WIN32
+            byte* ptr = (byte*)_aligned_malloc(size ? size : 1, align);
+#else
+            void* mem = nullptr;
+            byte* ptr = posix_memalign(&mem, align < sizeof(void*) ? sizeof(void*) : align, size ? size : 1) == 0 ? (byte*)mem : nullptr;
+#endif
+
+#ifdef __linux__
+            if ((ptr) && (align == hugePageSize))
+                madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+            return ptr;
+        }
+
+        void Deallocate(byte* ptr, const std::size_t&) noexcept override
+        {
+#ifdef _WIN32
+            _aligned_free(ptr);
+#else
+            free(ptr);
+#endif
+            return;
+        }
+
+        std::size_t GetAlignment() const noexcept
+        {
+            return alignment;
+        }
+
+    private:
+        static constexpr std::size_t hugePageSize = 2 * 1024 * 1024;
+
+        const std::size_t alignment;
+        const bool useHugePages;
+    };
+
+    // Keeps the pixel buffers of destroyed BMPs around, to hand them to the next BMPs of a similar size.
+    // Sizes get rounded up to size classes (4 per power of two, so at most 25% waste), and every size class has its own free list.
+    // Memory it doesn't have cached comes from upstream. Thread-safe.
+    class PixelBufferPool : public PixelAllocator
+    {
+    public:
+        // maxCachedBytes caps how much memory the free lists may hold on to. Anything beyond that goes straight back to upstream
+        explicit PixelBufferPool(std::shared_ptr<PixelAllocator> upstream = std::make_shared<MallocAllocator>(), const std::size_t& maxCachedBytes = std::size_t(1) << 30)
+            : upstream{std::move(upstream)}, maxCachedBytes{maxCachedBytes}, cachedBytes{0}
+        {
+            return;
+        }
+
+        PixelBufferPool(const PixelBufferPool&) = delete;
+        PixelBufferPool& operator=(const PixelBufferPool&) = delete;
+
+        byte* Allocate(const std::size_t& size) override
+        {
+            std::size_t classSize;
+            const std::size_t sizeClass = GetSizeClass(size, classSize);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<byte*>& freeList = freeLists[sizeClass];
+                if (!freeList.empty())
+                {
+                    byte* ptr = freeList.back();
+                    freeList.pop_back();
+                    cachedBytes -= classSize;
+                    return ptr;
+                }
+            }
+
+            return upstream->Allocate(classSize);
+        }
+
+        void Deallocate(byte* ptr, const std::size_t& size) noexcept override
+        {
+            std::size_t classSize;
+            const std::size_t sizeClass = GetSizeClass(size, classSize);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (cachedBytes + classSize <= maxCachedBytes)
+                {
+                    try
+                    {
+                        freeLists[sizeClass].push_back(ptr);
+                        cachedBytes += classSize;
+                        return;
+                    }
+                    catch (...)
+                    {
+                        // Couldn't grow the free list. Just hand it back then
+                    }
+                }
+            }
+
+            upstream->Deallocate(ptr, classSize);
+            return;
+        }
+
+        byte* Reallocate(byte* ptr, const std::size_t& oldSize, const std::size_t& newSize) override
+        {
+            // Within the same size class there's nothing to do
+            std::size_t oldClassSize;
+            std::size_t newClassSize;
+            if (GetSizeClass(oldSize, oldClassSize) == GetSizeClass(newSize, newClassSize))
+                return ptr;
+
+            return PixelAllocator::Reallocate(ptr, oldSize, newSize);
+        }
+
+        // Will hand every cached buffer back to upstream
+        void Trim() noexcept
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::size_t i = 0; i < numSizeClasses; i++)
+            {
+                std::size_t classSize;
+                GetSizeClass(ClassToSize(i), classSize);
+                for (byte* ptr : freeLists[i])
+                    upstream->Deallocate(ptr, classSize);
+                freeLists[i].clear();
+            }
+            cachedBytes = 0;
+            return;
+        }
+
+        // How many bytes the free lists hold on to right now
+        std::size_t GetCachedBytes() noexcept
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return cachedBytes;
+        }
+
+        ~PixelBufferPool()
+        {
+            Trim();
+            return;
+        }
+
+    private:
+        static constexpr std::size_t minClassSize = 4096;
+        static constexpr std::size_t numSizeClasses = 4 * 64;
+
+        // Will find the size class size falls into, and how large the buffers of that class are
+        static std::size_t GetSizeClass(const std::size_t& size, std::size_t& classSize) noexcept
+        {
+            if (size <= minClassSize)
+            {
+                classSize = minClassSize;
+                return 0;
+            }
+
+            // size lies within (2^msb, 2^(msb+1)], which gets split into 4 classes
+            std::size_t msb = 0;
+            for (std::size_t v = size - 1; v >>= 1;)
+                msb++;
+
+            const std::size_t step = std::size_t(1) << (msb - 2);
+            const std::size_t numSteps = (size + step - 1) / step; // 5 to 8
+            classSize = numSteps * step;
+            return 1 + (msb - 12) * 4 + (numSteps - 5);
+        }
+
+        // Will return the largest size that falls into sizeClass
+        static std::size_t ClassToSize(const std::size_t& sizeClass) noexcept
+        {
+            if (!sizeClass)
+                return minClassSize;
+
+            const std::size_t msb = (sizeClass - 1) / 4 + 12;
+            const std::size_t numSteps = (sizeClass - 1) % 4 + 5;
+            return numSteps << (msb - 2);
+        }
+
+        const std::shared_ptr<PixelAllocator> upstream;
+        const std::size_t maxCachedBytes;
+        std::size_t cachedBytes;
+        std::vector<byte*> freeLists[numSizeClasses];
+        std::mutex mutex;
+    };
+
+#ifdef BMPLIB_INSTRUMENT
+    // Measures how long each phase of Read(), Write(), ReInitialize() and ConvertTo() takes, and how many bytes it moves.
+    // Only exists with #define BMPLIB_INSTRUMENT. Without it, none of this gets compiled in
+    namespace Instrumentation
+    {
+        enum class OPERATION
+        {
+            READ,
+            WRITE,
+            REINITIALIZE,
+            CONVERT_TO,
+            COUNT
+        };
+
+        enum class PHASE
+        {
+            OPEN,     // opening, flushing and closing files
+            HEADER,   // reading/parsing or building/writing the file header
+            ALLOCATE, // getting pixel buffers and scratch memory (and making them black)
+            IO,       // reading or writing pixel data
+            SWIZZLE,  // turning scanlines into pixel buffer rows, and back
+            CONVERT,  // converting between color modes
+            COUNT
+        };
+
+        struct PhaseStats
+        {
+            std::uint64_t nanoseconds;
+            std::uint64_t bytes;
+        };
+
+        // What one call did. Gets handed to the callback
+        struct CallRecord
+        {
+            OPERATION operation;
+            std::uint64_t nanoseconds;
+            PhaseStats phases[(std::size_t)PHASE::COUNT];
+        };
+
+        // What all calls of one operation did, summed up since the last ResetCounters()
+        struct Counters
+        {
+            std::uint64_t calls;
+            std::uint64_t nanoseconds;
+            PhaseStats phases[(std::size_t)PHASE::COUNT];
+        };
+
+        using Callback = std::function<void(const CallRecord&)>;
+
+        struct State
+        {
+            std::atomic<std::uint64_t> calls[(std::size_t)OPERATION::COUNT];
+            std::atomic<std::uint64_t> nanoseconds[(std::size_t)OPERATION::COUNT];
+            std::atomic<std::uint64_t> phaseNanoseconds[(std::size_t)OPERATION::COUNT][(std::size_t)PHASE::COUNT];
+            std::atomic<std::uint64_t> phaseBytes[(std::size_t)OPERATION::COUNT][(std::size_t)PHASE::COUNT];
+            std::mutex callbackMutex;
+            std::shared_ptr<Callback> callback;
+        };
+
+        inline State& GetState()
+        {
+            static State state{};
+            return state;
+        }
+
+        // Counters get updated one by one, so while other threads are still busy, the result may be off by a call or so
+        inline Counters GetCounters(const OPERATION& operation)
+        {
+            State& state = GetState();
+            const std::size_t op = (std::size_t)operation;
+
+            Counters counters;
+            counters.calls = state.calls[op];
+            counters.nanoseconds = state.nanoseconds[op];
+            for (std::size_t p = 0; p < (std::size_t)PHASE::COUNT; p++)
+            {
+                counters.phases[p].nanoseconds = state.phaseNanoseconds[op][p];
+                counters.phases[p].bytes = state.phaseBytes[op][p];
+            }
+            return counters;
+        }
+
+        inline void ResetCounters()
+        {
+            State& state = GetState();
+            for (std::size_t op = 0; op < (std::size_t)OPERATION::COUNT; op++)
+            {
+                state.calls[op] = 0;
+                state.nanoseconds[op] = 0;
+                for (std::size_t p = 0; p < (std::size_t)PHASE::COUNT; p++)
+                {
+                    state.phaseNanoseconds[op][p] = 0;
+                    state.phaseBytes[op][p] = 0;
+                }
+            }
+            return;
+        }
+
+        // Will call callback after every instrumented call, on the thread that made it. An empty callback turns it off again
+        inline void SetCallback(Callback callback)
+        {
+            State& state = GetState();
+            std::lock_guard<std::mutex> lock(state.callbackMutex);
+            state.callback = callback ? std::make_shared<Callback>(std::move(callback)) : nullptr;
+            return;
+        }
+
+        inline const char* GetOperationName(const OPERATION& operation)
+        {
+            static const char* const names[] = { "Read", "Write", "ReInitialize", "ConvertTo" };
+            return operation < OPERATION::COUNT ? names[(std::size_t)operation] : "?";
+        }
+
+        inline const char* GetPhaseName(const PHASE& phase)
+        {
+            static const char* const names[] = { "open", "header", "allocate", "io", "swizzle", "convert" };
+            return phase < PHASE::COUNT ? names[(std::size_t)phase] : "?";
+        }
+
+        // Lives for the duration of one call. Every Lap() books the time since the last one onto a phase.
+        // If a call hands off to another overload of itself (like Read(filename) to Read(istream)), the inner recorder books onto the outer one
+        class CallRecorder
+        {
+        public:
+            explicit CallRecorder(const OPERATION& operation) noexcept
+                : record{}, outer{GetActive()}
+            {
+                record.operation = operation;
+                start = last = std::chrono::steady_clock::now();
+                if ((!outer) || (outer->record.operation != operation))
+                {
+                    outer = nullptr;
+                    previous = GetActive();
+                    GetActive() = this;
+                }
+                return;
+            }
+
+            void Lap(const PHASE& phase, const std::size_t& bytes = 0) noexcept
+            {
+                if (outer)
+                {
+                    outer->Lap(phase, bytes);
+                    return;
+                }
+
+                const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                record.phases[(std::size_t)phase].nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+                record.phases[(std::size_t)phase].bytes += bytes;
+                last = now;
+                return;
+            }
+
+            CallRecorder(const CallRecorder&) = delete;
+            CallRecorder& operator=(const CallRecorder&) = delete;
+
+            ~CallRecorder()
+            {
+                if (outer)
+                    return;
+
+                GetActive() = previous;
+                record.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+                State& state = GetState();
+                const std::size_t op = (std::size_t)record.operation;
+                state.calls[op]++;
+                state.nanoseconds[op] += record.nanoseconds;
+                for (std::size_t p = 0; p < (std::size_t)PHASE::COUNT; p++)
+                {
+                    state.phaseNanoseconds[op][p] += record.phases[p].nanoseconds;
+                    state.phaseBytes[op][p] += record.phases[p].bytes;
+                }
+
+                std::shared_ptr<Callback> callback;
+                {
+                    std::lock_guard<std::mutex> lock(state.callbackMutex);
+                    callback = state.callback;
+                }
+
+                // A throwing callback would take the whole program down from in here
+                if (callback)
+                {
+                    try
+                    {
+                        (*callback)(record);
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+                return;
+            }
+
+        private:
+            // The recorder of the instrumented call that is running on this thread right now
+            static CallRecorder*& GetActive() noexcept
+            {
+                static thread_local CallRecorder* active = nullptr;
+                return active;
+            }
+
+            CallRecord record;
+            CallRecorder* outer; // who we book onto instead, if nested
+            CallRecorder* previous = nullptr;
+            std::chrono::steady_clock::time_point start;
+            std::chrono::steady_clock::time_point last;
+        };
+    }
+
+#endif
+    // Work-stealing thread pool that BMPs can spread their row bands over (see BMP::SetThreadPool()).
+    // Every worker has its own task queue. It works off its own queue back to front, and steals from the front of the others once it runs dry.
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(const std::size_t& numThreads = std::thread::hardware_concurrency())
+            : numPending{0}, nextQueue{0}, stopping{false}
+        {
+            const std::size_t n = numThreads ? numThreads : 1;
+            for (std::size_t i = 0; i < n; i++)
+                queues.emplace_back(new TaskQueue);
+
+            for (std::size_t i = 0; i < n; i++)
+                threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+
+            return;
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        std::size_t GetNumThreads() const noexcept
+        {
+            return threads.size();
+        }
+
+        // Will run task on one of the workers, some time soon
+        void Submit(std::function<void()> task)
+        {
+            Push(nextQueue++ % queues.size(), std::move(task));
+            return;
+        }
+
+        // Will call func(begin, end) for every chunk of [0, count), each at most grainSize long, spread over the workers.
+        // The calling thread helps out, and only returns once every chunk is done. If a chunk throws, the first exception gets rethrown here
+        void ParallelFor(const std::size_t& count, const std::size_t& grainSize, const std::function<void(std::size_t, std::size_t)>& func)
+        {
+            const std::size_t grain = grainSize ? grainSize : 1;
+            const std::size_t numChunks = (count + grain - 1) / grain;
+            if (numChunks <= 1)
+            {
+                if (count)
+                    func(0, count);
+                return;
+            }
+
+            std::size_t remaining = numChunks;
+            std::mutex doneMutex;
+            std::condition_variable done;
+            std::exception_ptr error;
+
+            for (std::size_t c = 0; c < numChunks; c++)
+            {
+                Push(c % queues.size(), [&, c]()
+                {
+                    std::exception_ptr chunkError;
+                    try
+                    {
+                        func(c * grain, (c + 1) * grain < count ? (c + 1) * grain : count);
+                    }
+                    catch (...)
+                    {
+                        chunkError = std::current_exception();
+                    }
+
+                    // Everything that touches our stack frame happens under the lock, so it's still alive
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    if ((chunkError) && (!error))
+                        error = chunkError;
+                    if (--remaining == 0)
+                        done.notify_all();
+                });
+            }
+
+            // Help out instead of just waiting
+            while (TryRunTask(0))
+                ;
+
+            std::unique_lock<std::mutex> lock(doneMutex);
+            done.wait(lock, [&]() { return remaining == 0; });
+
+            if (error)
+                std::rethrow_exception(error);
+
+            return;
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                stopping = true;
+            }
+            wake.notify_all();
+
+            for (std::thread& t : threads)
+                t.join();
+
+            return;
+        }
+
+    private:
+        struct TaskQueue
+        {
+            std::deque<std::function<void()>> tasks;
+            std::mutex mutex;
+        };
+
+        void Push(const std::size_t& queue, std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+                queues[queue]->tasks.push_back(std::move(task));
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                numPending++;
+            }
+            wake.notify_one();
+            return;
+        }
+
+        // Will run one task, from our own queue if possible, or stolen from another one. Returns false if there was nothing to do
+        bool TryRunTask(const std::size_t& home)
+        {
+            for (std::size_t i = 0; i < queues.size(); i++)
+            {
+                TaskQueue& queue = *queues[(home + i) % queues.size()];
+                std::function<void()> task;
+                {
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.tasks.empty())
+                        continue;
+
+                    if (i == 0)
+                    {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    }
+                    else
+                    {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    numPending--;
+                }
+
+                task();
+                return true;
+            }
+
+            return false;
+        }
+
+        void WorkerLoop(const std::size_t home)
+        {
+            while (true)
+            {
+                if (TryRunTask(home))
+                    continue;
+
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                wake.wait(lock, [&]() { return (stopping) || (numPending > 0); });
+                if ((stopping) && (numPending == 0))
+                    return;
+            }
+        }
+
+        std::vector<std::unique_ptr<TaskQueue>> queues;
+        std::vector<std::thread> threads;
+        std::mutex sleepMutex;
+        std::condition_variable wake;
+        std::size_t numPending; // tasks that sit in a queue. Guarded by sleepMutex
+        std::atomic<std::size_t> nextQueue;
+        bool stopping;
+    };
+
+    // File that reads and writes whole chunks at given offsets in the background, so the caller can get on with the next chunk meanwhile.
+    // Uses io_uring where the kernel lets us, and a helper thread otherwise. One transfer can be in flight at a time.
+    // This is what ReadAsync() and WriteAsync() are built on
+    class OverlappedFile
+    {
+    public:
+        OverlappedFile() noexcept
+        {
+            return;
+        }
+
+        OverlappedFile(const OverlappedFile&) = delete;
+        OverlappedFile& operator=(const OverlappedFile&) = delete;
+
+        bool Open(const std::string& filename, const bool forWriting)
+        {
+            Close();
+            writing = forWriting;
+            failed = false;
+
+#ifdef __linux__
+            fd = forWriting ? open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+
+#ifdef BMPLIB_IO_URING
+            SetupRing();
+#endif
+#else
+            fs.open(filename, (forWriting ? std::ios::out | std::ios::trunc : std::ios::in) | std::ios::binary);
+            if (!fs.good())
+                return false;
+#endif
+            isOpen = true;
+            return true;
+        }
+
+        bool IsOpen() const noexcept
+        {
+            return isOpen;
+        }
+
+        // Whether transfers go through io_uring, rather than the helper thread
+        bool UsesIoUring() const noexcept
+        {
+            return ringFd >= 0;
+        }
+
+        // Will start moving size bytes between buffer and the file at offset. buffer has to stay put until Wait() returns
+        void Submit(byte* buffer, const std::size_t& size, const std::size_t& offset)
+        {
+            Wait();
+            pendingBuffer = buffer;
+            pendingSize = size;
+            pendingOffset = offset;
+            transferred = 0;
+            inFlight = true;
+
+#ifdef BMPLIB_IO_URING
+            if (ringFd >= 0)
+            {
+                if (SubmitToRing())
+                    return;
+
+                // The kernel wouldn't take it (out of resources, for example). The helper thread takes over for good
+                TeardownRing();
+            }
+#endif
+            // One thread for all the transfers of this file, not one per transfer
+            if (!helper.joinable())
+            {
+                helperQuit = false;
+                helper = std::thread([this]() { HelperLoop(); });
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(helperMutex);
+                helperHasWork = true;
+                helperDone = false;
+            }
+            helperSignal.notify_all();
+            return;
+        }
+
+        // Will wait for the transfer in flight, if any. Returns how many bytes it moved.
+        // That's less than asked for if a read hit the end of the file, or something went wrong (see Failed())
+        std::size_t Wait()
+        {
+            if (!inFlight)
+                return transferred;
+
+#ifdef BMPLIB_IO_URING
+            if (ringFd >= 0)
+            {
+                while (true)
+                {
+                    const long long result = WaitForRing();
+                    if (result <= 0)
+                    {
+                        if ((result < 0) || (writing))
+                            failed = true;
+                        break;
+                    }
+
+                    transferred += (std::size_t)result;
+                    if (transferred == pendingSize)
+                        break;
+
+                    // Partial transfer. Go for the rest. If the kernel won't take that, it gets done right here
+                    if (!SubmitToRing())
+                    {
+                        TeardownRing();
+                        const long long rest = TransferBlocking(pendingBuffer + transferred, pendingSize - transferred, pendingOffset + transferred);
+                        if (rest < 0)
+                            failed = true;
+                        else
+                            transferred += (std::size_t)rest;
+                        break;
+                    }
+                }
+
+                inFlight = false;
+                return transferred;
+            }
+#endif
+            long long result;
+            {
+                std::unique_lock<std::mutex> lock(helperMutex);
+                helperSignal.wait(lock, [&]() { return helperDone; });
+                result = helperResult;
+            }
+
+            if (result < 0)
+                failed = true;
+            transferred = result < 0 ? 0 : (std::size_t)result;
+            inFlight = false;
+            return transferred;
+        }
+
+        // Whether any transfer since Open() ran into an error
+        bool Failed() const noexcept
+        {
+            return failed;
+        }
+
+        // Will wait for the transfer in flight, and close the file. Returns false if anything went wrong on the way
+        bool Close()
+        {
+            if (!isOpen)
+                return true;
+
+            Wait();
+            bool success = !failed;
+            StopHelper();
+
+#ifdef BMPLIB_IO_URING
+            TeardownRing();
+#endif
+#ifdef __linux__
+            if (close(fd) != 0)
+                success = false;
+            fd = -1;
+#else
+            fs.close();
+            success = success && !fs.fail();
+#endif
+            isOpen = false;
+            return success;
+        }
+
+        ~OverlappedFile()
+        {
+            Close();
+            return;
+        }
+
+    private:
+        // The helper thread. Picks up one transfer at a time from Submit(), and hands its result to Wait()
+        void HelperLoop()
+        {
+            std::unique_lock<std::mutex> lock(helperMutex);
+            while (true)
+            {
+                helperSignal.wait(lock, [&]() { return (helperHasWork) || (helperQuit); });
+                if (!helperHasWork)
+                    return;
+
+                helperHasWork = false;
+                lock.unlock();
+                const long long result = TransferBlocking(pendingBuffer, pendingSize, pendingOffset);
+                lock.lock();
+
+                helperResult = result;
+                helperDone = true;
+                helperSignal.notify_all();
+            }
+        }
+
+        void StopHelper()
+        {
+            if (!helper.joinable())
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(helperMutex);
+                helperQuit = true;
+            }
+            helperSignal.notify_all();
+            helper.join();
+            return;
+        }
+
+        // Will move the whole transfer on the calling thread. Returns how many bytes it moved, or -1 on errors
+        long long TransferBlocking(byte* buffer, const std::size_t& size, const std::size_t& offset)
+        {
+            std::size_t done = 0;
+#ifdef __linux__
+            while (done < size)
+            {
+                const ssize_t result = writing ? pwrite(fd, buffer + done, size - done, offset + done) : pread(fd, buffer + done, size - done, offset + done);
+                if ((result < 0) && (errno == EINTR))
+                    continue;
+                if (result < 0)
+                    return -1;
+                if (result == 0)
+                    return writing ? -1 : (long long)done;
+                done += (std::size_t)result;
+            }
+#else
+            if (writing)
+            {
+                fs.seekp(offset);
+                fs.write((const char*)buffer, size);
+                if (!fs.good())
+                    return -1;
+                done = size;
+            }
+            else
+            {
+                fs.seekg(offset);
+                fs.read((char*)buffer, size);
+                done = (std::size_t)fs.gcount();
+                fs.clear(); // hitting the end of the file isn't an error here
+            }
+#endif
+            return (long long)done;
+        }
+
+#ifdef BMPLIB_IO_URING
+        static int SysIoUringSetup(const unsigned& entries, io_uring_params* params) noexcept
+        {
+            return (int)syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        static int SysIoUringEnter(const int& ringFd, const unsigned& toSubmit, const unsigned& minComplete, const unsigned& flags) noexcept
+        {
+            return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+        }
+
+        // Will set up a tiny ring for this file. If the kernel says no (too old, or forbidden by a sandbox), we stay with the helper thread
+        void SetupRing() noexcept
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ringFd = SysIoUringSetup(2, &params);
+            if (ringFd < 0)
+                return;
+
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (singleMmap)
+                sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+            sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if ((sqRing == MAP_FAILED) || (cqRing == MAP_FAILED) || ((void*)sqes == MAP_FAILED))
+            {
+                TeardownRing();
+                return;
+            }
+
+            sqTail = (unsigned*)((byte*)sqRing + params.sq_off.tail);
+            sqMask = (unsigned*)((byte*)sqRing + params.sq_off.ring_mask);
+            sqArray = (unsigned*)((byte*)sqRing + params.sq_off.array);
+            cqHead = (unsigned*)((byte*)cqRing + params.cq_off.head);
+            cqTail = (unsigned*)((byte*)cqRing + params.cq_off.tail);
+            cqMask = (unsigned*)((byte*)cqRing + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)((byte*)cqRing + params.cq_off.cqes);
+            return;
+        }
+
+        void TeardownRing() noexcept
+        {
+            if ((sqes) && ((void*)sqes != MAP_FAILED))
+                munmap(sqes, sqesSize);
+            if ((cqRing) && (cqRing != MAP_FAILED) && (cqRing != sqRing))
+                munmap(cqRing, cqRingSize);
+            if ((sqRing) && (sqRing != MAP_FAILED))
+                munmap(sqRing, sqRingSize);
+            if (ringFd >= 0)
+                close(ringFd);
+
+            sqRing = cqRing = nullptr;
+            sqes = nullptr;
+            ringFd = -1;
+            return;
+        }
+
+        // Will queue up whatever is left of the pending transfer. We're the only ones submitting, so the tail is ours.
+        // Returns false if io_uring_enter() failed. The entry stays in the ring then, so the ring has to go
+        bool SubmitToRing() noexcept
+        {
+            iov.iov_base = pendingBuffer + transferred;
+            iov.iov_len = pendingSize - transferred;
+
+            const unsigned tail = *sqTail;
+            const unsigned index = tail & *sqMask;
+            io_uring_sqe& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.fd = fd;
+            sqe.addr = (unsigned long long)&iov;
+            sqe.len = 1;
+            sqe.off = pendingOffset + transferred;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            while (true)
+            {
+                const int result = SysIoUringEnter(ringFd, 1, 0, 0);
+                if (result == 1)
+                    return true;
+                if ((result < 0) && (errno == EINTR))
+                    continue;
+                return false;
+            }
+        }
+
+        // Will wait for the one completion we're expecting. Returns its result: bytes moved, or -errno
+        long long WaitForRing() noexcept
+        {
+            while (true)
+            {
+                const unsigned head = *cqHead;
+                if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+                {
+                    const long long result = cqes[head & *cqMask].res;
+                    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                    return result;
+                }
+
+                if ((SysIoUringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR))
+                    return -errno;
+            }
+        }
+
+        void* sqRing = nullptr;
+        void* cqRing = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        std::size_t sqRingSize = 0;
+        std::size_t cqRingSize = 0;
+        std::size_t sqesSize = 0;
+        unsigned* sqTail = nullptr;
+        unsigned* sqMask = nullptr;
+        unsigned* sqArray = nullptr;
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned* cqMask = nullptr;
+        io_uring_cqe* cqes = nullptr;
+        iovec iov;
+#endif
+
+#ifdef __linux__
+        int fd = -1;
+#else
+        std::fstream fs;
+#endif
+        int ringFd = -1;
+        bool isOpen = false;
+        bool writing = false;
+        bool inFlight = false;
+        bool failed = false;
+        byte* pendingBuffer = nullptr;
+        std::size_t pendingSize = 0;
+        std::size_t pendingOffset = 0;
+        std::size_t transferred = 0;
+        std::thread helper;
+        std::mutex helperMutex;
+        std::condition_variable helperSignal;
+        bool helperHasWork = false; // All of these are guarded by helperMutex
+        bool helperDone = false;
+        bool helperQuit = false;
+        long long helperResult = 0;
+    };
+
+    // Runs ReadAsync() and WriteAsync(). Created on first use
+    inline ThreadPool& GetIoExecutor()
+    {
+        static ThreadPool executor(2);
+        return executor;
+    }
+
+    // How BMP::Write() lays out the file. The defaults make the most widely readable bmp
+    struct WriteOptions
+    {
+        enum class HIGH_COLOR
+        {
+            NONE,   // 24 bit for RGB, 32 bit for RGBA
+            RGB565, // 16 bit: 5 bits red, 6 bits green, 5 bits blue
+            RGB555  // 16 bit: 5 bits per channel, top bit unused
+        };
+
+        // Run length encode (BI_RLE8) the pixel array. Only applies to BW images, others get written as usual.
+        // Pays off for images with large flat areas, like scans, masks and screenshots
+        bool rle = false;
+
+        // Store RGB and RGBA images with 16 bits per pixel. A third smaller than 24 bit, but alpha gets dropped. BW images ignore this
+        HIGH_COLOR highColor = HIGH_COLOR::NONE;
+
+        // With highColor, dither (4x4 ordered) instead of rounding to the nearest level. Trades banding in gradients for a fine, regular pattern
+        bool dither = false;
+
+        // Store the scanlines top to bottom (negative height), so the file has the same row order as the pixel buffer.
+        // Rows get written front to back, and BW, BGR and BGRA images without padding go out in one piece.
+        // Run length encoded images are always bottom to top, that's all the format allows
+        bool topDown = false;
+    };
+
+    // How Read() decodes an image. Same goes for MappedBMP and BMPStreamReader
+    struct ReadOptions
+    {
+        // Decode color images to BGR / BGRA instead of RGB / RGBA. That's the byte order of 24 and 32 bit files, so there's nothing to swizzle.
+        // BW images stay BW
+        bool bgr = false;
+
+        // Shrink the image by 2, 4 or 8 while reading it, averaging 2x2, 4x4 or 8x8 blocks. The blocks at the right and bottom edges can be smaller.
+        // Besides the shrunk image, this only needs a few rows of memory, never the full size image (unless it's run length encoded). 1 reads it at full size.
+        // Only Read() and ReadAsync() of whole images do this. Reading a rectangle, MappedBMP and BMPStreamReader fail if this isn't 1
+        std::size_t downscale = 1;
+    };
+
+    class BMP
+    {
+    public:
+        enum class COLOR_MODE
+        {
+            BW, // 1 channel. Gets stored as 8 bit, with a gray palette
+            RGB,
+            RGBA,
+            BGR, // Like RGB, but blue first. That's how the file stores it, so Read() and Write() only have to copy
+            BGRA // Like RGBA, but blue first. Same deal
+        };
+
+        BMP() noexcept
+        {
+            width = 0;
+            height = 0;
+            colorMode = COLOR_MODE::BW;
+            sizeofPxlbfr = 0;
+            capacityPxlbfr = 0;
+            numChannelsFile = 0;
+            numChannelsPXBF = 0;
+            pixelbfr = nullptr;
+            isInitialized = false;
+            return;
+        }
+
+        // Set zeroFill to false to skip making the image black, if you are going to overwrite every pixel anyway
+        explicit BMP(const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode = BMP::COLOR_MODE::RGB, const bool zeroFill = true)
+            : isInitialized{false}, pixelbfr{nullptr}, sizeofPxlbfr{0}, capacityPxlbfr{0}
+        {
+            ReInitialize(width, height, colorMode, zeroFill);
+            return;
+        }
+
+        // Will get the memory for its pixel buffer from allocator, instead of malloc
+        explicit BMP(std::shared_ptr<PixelAllocator> allocator) noexcept
+            : BMP()
+        {
+            this->allocator = std::move(allocator);
+            return;
+        }
+
+        // Will get the memory for its pixel buffer from allocator, instead of malloc
+        explicit BMP(const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode, std::shared_ptr<PixelAllocator> allocator, const bool zeroFill = true)
+            : isInitialized{false}, pixelbfr{nullptr}, sizeofPxlbfr{0}, capacityPxlbfr{0}, allocator{std::move(allocator)}
+        {
+            ReInitialize(width, height, colorMode, zeroFill);
+            return;
+        }
+
+        // BMPs don't copy implicitly, since that would mean copying the whole pixel buffer. Use Clone() or CopyFrom() for that
+        BMP(const BMP&) = delete;
+        BMP& operator=(const BMP&) = delete;
+
+        // Will take over other's pixel buffer (and allocator). other ends up uninitialized
+        BMP(BMP&& other) noexcept
+            : BMP()
+        {
+            Swap(other);
+            return;
+        }
+
+        // Will take over other's pixel buffer (and allocator), and free our own. other ends up uninitialized
+        BMP& operator=(BMP&& other) noexcept
+        {
+            if (this != &other)
+            {
+                BMP old(std::move(*this));
+                Swap(other);
+            }
+            return *this;
+        }
+
+        // Will swap two images, without copying any pixels
+        void Swap(BMP& other) noexcept
+        {
+            std::swap(width, other.width);
+            std::swap(height, other.height);
+            std::swap(numChannelsFile, other.numChannelsFile);
+            std::swap(numChannelsPXBF, other.numChannelsPXBF);
+            std::swap(colorMode, other.colorMode);
+            std::swap(isInitialized, other.isInitialized);
+            std::swap(pixelbfr, other.pixelbfr);
+            std::swap(sizeofPxlbfr, other.sizeofPxlbfr);
+            std::swap(capacityPxlbfr, other.capacityPxlbfr);
+            std::swap(allocator, other.allocator);
+            std::swap(threadPool, other.threadPool);
+            return;
+        }
+
+        // Will turn this image into a deep copy of other. Reuses our pixel buffer if it is large enough
+        void CopyFrom(const BMP& other)
+        {
+            if (this == &other)
+                return;
+
+            if (!other.isInitialized)
+            {
+                ReleasePixelBuffer();
+                return;
+            }
+
+            ReInitialize(other.width, other.height, other.colorMode, false);
+            memcpy(pixelbfr, other.pixelbfr, sizeofPxlbfr);
+            return;
+        }
+
+        // Will return a deep copy of this image, using the same allocator
+        BMP Clone() const
+        {
+            BMP copy(allocator);
+            copy.CopyFrom(*this);
+            return copy;
+        }
+
+        // Will get the memory for the pixel buffer from allocator from now on. nullptr means malloc.
+        // An existing pixel buffer gets moved over to the new allocator
+        void SetAllocator(std::shared_ptr<PixelAllocator> allocator)
+        {
+            if (isInitialized)
+            {
+                byte* moved = allocator ? allocator->Allocate(sizeofPxlbfr) : (byte*)malloc(sizeofPxlbfr);
+                if (!moved)
+                {
+                    // too bad!
+                    ThrowException("Can't allocate memory for pixelbuffer!");
+                }
+
+                memcpy(moved, pixelbfr, sizeofPxlbfr);
+                FreePixelMemory();
+                pixelbfr = moved;
+                capacityPxlbfr = sizeofPxlbfr;
+            }
+
+            this->allocator = std::move(allocator);
+            return;
+        }
+
+        const std::shared_ptr<PixelAllocator>& GetAllocator() const noexcept
+        {
+            return allocator;
+        }
+
+        // Will spread Read(), Write() and ConvertTo() over the workers of threadPool, one band of rows each.
+        // nullptr (the default) does everything on the calling thread. One pool can be shared by as many images as you want
+        void SetThreadPool(std::shared_ptr<ThreadPool> threadPool) noexcept
+        {
+            this->threadPool = std::move(threadPool);
+            return;
+        }
+
+        const std::shared_ptr<ThreadPool>& GetThreadPool() const noexcept
+        {
+            return threadPool;
+        }
+
+        // Set zeroFill to false to skip making the image black, if you are going to overwrite every pixel anyway.
+        // The pixel buffer will then contain whatever happened to be in that memory before
+        void ReInitialize(const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode = BMP::COLOR_MODE::RGB, const bool zeroFill = true)
+        {
+            if ((!width) || (!height)) ThrowException("Bad image dimensions!");
+            BMPLIB_INSTRUMENT_CALL(REINITIALIZE);
+
+            // Initialize bunch of stuff
+            this->width = width;
+            this->height = height;
+            this->colorMode = colorMode;
+
+            numChannelsFile = GetNumChannelsFile(colorMode);
+            numChannelsPXBF = GetNumChannelsPXBF(colorMode);
+
+            sizeofPxlbfr = sizeof(byte) * width * height * numChannelsPXBF;
+
+            // Only get a new pixelbuffer if the one we have is too small
+            if ((!isInitialized) || (sizeofPxlbfr > capacityPxlbfr))
+            {
+                // Delete pixelbuffer if already exists
+                if (isInitialized) FreePixelMemory();
+                isInitialized = false;
+                capacityPxlbfr = 0;
+
+                // Try to allocate memory for the pixelbuffer
+                pixelbfr = allocator ? allocator->Allocate(sizeofPxlbfr) : (byte*)malloc(sizeofPxlbfr);
+                if (!pixelbfr)
+                {
+                    // too bad!
+                    ThrowException("Can't allocate memory for pixelbuffer!");
+                }
+
+                capacityPxlbfr = sizeofPxlbfr;
+                BMPLIB_INSTRUMENT_LAP(ALLOCATE, sizeofPxlbfr);
+            }
+
+            // Make image black
+            if (zeroFill)
+                memset(pixelbfr, 0, sizeofPxlbfr);
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, 0);
+
+            isInitialized = true;
+            return;
+        }
+
+        // Will convert between color modes. Set isNonColorData to true to treat pixeldata as raw values rather than color.
+        // Conversions to BW follow the rounding contract described at Kernels::GrayWeights
+        void ConvertTo(const BMP::COLOR_MODE& convto, bool isNonColorData = false)
+        {
+            if (!isInitialized)
+                ThrowException("Not initialized!");
+
+            if (convto == colorMode)
+                return;
+
+            BMPLIB_INSTRUMENT_CALL(CONVERT_TO);
+
+            // Everything happens right inside the pixel buffer.
+            // Conversions that shrink it run front to back and keep the spare memory around for later (see ShrinkToFit()),
+            // conversions that grow it get the memory first, and run back to front.
+            const std::size_t numPx = width * height;
+            const std::size_t newSizeofPxlbfr = sizeof(byte) * numPx * GetNumChannelsPXBF(convto);
+
+            // BGR and BGRA convert just like RGB and RGBA. They only get red and blue swapped on top, or weighted the other way round for BW
+            const COLOR_MODE from = GetRgbOrder(colorMode);
+            const COLOR_MODE to = GetRgbOrder(convto);
+            const bool swapRB = (IsBgrOrder(colorMode) != IsBgrOrder(convto)) && (from != COLOR_MODE::BW) && (to != COLOR_MODE::BW);
+            Kernels::GrayWeights grayWeights = isNonColorData ? Kernels::grayWeightsNonColor : Kernels::grayWeightsColor;
+            if (IsBgrOrder(colorMode))
+                std::swap(grayWeights.r, grayWeights.b);
+
+            if (newSizeofPxlbfr > capacityPxlbfr)
+            {
+                ResizePixelBuffer(newSizeofPxlbfr);
+                BMPLIB_INSTRUMENT_LAP(ALLOCATE, newSizeofPxlbfr);
+            }
+
+            switch (from)
+            {
+            case COLOR_MODE::BW:
+                switch (to)
+                {
+                case COLOR_MODE::RGB:
+                    // BW -> RGB
+                    ConvertPixelBuffer(Kernels::GrayToRgb24, convto);
+                    break;
+
+                case COLOR_MODE::RGBA:
+                    // BW -> RGBA
+                    ConvertPixelBuffer(Kernels::GrayToRgba32, convto);
+                    break;
+
+                default:
+                    break;
+                }
+                break;
+
+            case COLOR_MODE::RGB:
+                switch (to)
+                {
+                case COLOR_MODE::BW:
+                    // RGB -> BW
+                    ConvertPixelBuffer([&grayWeights](const byte* src, byte* dst, const std::size_t& n) { Kernels::Rgb24ToGray(src, dst, n, grayWeights); }, convto);
+                    break;
+
+                case COLOR_MODE::RGB:
+                    // RGB <-> BGR
+                    ConvertPixelBuffer(Kernels::SwapRB24, convto);
+                    break;
+
+                case COLOR_MODE::RGBA:
+                    // RGB -> RGBA
+                    ConvertPixelBuffer(Kernels::Rgb24ToRgba32, convto, swapRB);
+                    break;
+
+                default:
+                    break;
+                }
+                break;
+
+            case COLOR_MODE::RGBA:
+                switch (to)
+                {
+                case COLOR_MODE::BW:
+                    // RGBA -> BW
+                    ConvertPixelBuffer([&grayWeights](const byte* src, byte* dst, const std::size_t& n) { Kernels::Rgba32ToGray(src, dst, n, grayWeights); }, convto);
+                    break;
+
+                case COLOR_MODE::RGB:
+                    // RGBA -> RGB
+                    ConvertPixelBuffer(Kernels::Rgba32ToRgb24, convto, swapRB);
+                    break;
+
+                case COLOR_MODE::RGBA:
+                    // RGBA <-> BGRA
+                    ConvertPixelBuffer(Kernels::SwapRB32, convto);
+                    break;
+
+                default:
+                    break;
+                }
+                break;
+
+            default:
+                break;
+            }
+            BMPLIB_INSTRUMENT_LAP(CONVERT, sizeofPxlbfr + newSizeofPxlbfr);
+
+            sizeofPxlbfr = newSizeofPxlbfr;
+            colorMode = convto;
+            numChannelsFile = GetNumChannelsFile(convto);
+            numChannelsPXBF = GetNumChannelsPXBF(convto);
+            return;
+        }
+
+        // Will hand back the memory the pixel buffer doesn't use right now, after shrinking ReInitialize() or ConvertTo() calls
+        void ShrinkToFit()
+        {
+            if ((isInitialized) && (sizeofPxlbfr < capacityPxlbfr))
+                ResizePixelBuffer(sizeofPxlbfr);
+
+            return;
+        }
+
+        byte* GetPixelBuffer() noexcept
+        {
+            return pixelbfr;
+        }
+
+        const byte* GetPixelBuffer() const noexcept
+        {
+            return pixelbfr;
+        }
+
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
+
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
+
+        COLOR_MODE GetColorMode() const noexcept
+        {
+            return colorMode;
+        }
+
+        bool IsInitialized() const noexcept
+        {
+            return isInitialized;
+        }
+
+        std::size_t CalculatePixelIndex(const std::size_t& x, const std::size_t& y) const
+        {
+            if ((x >= width) || (y >= height)) ThrowException("Pixel coordinates out of range!");
+
+            return numChannelsPXBF * ((y * width) + x);
+        }
+
+        byte* GetPixel(const std::size_t& x, const std::size_t& y)
+        {
+            return pixelbfr + CalculatePixelIndex(x, y);
+        }
+
+        const byte* GetPixel(const std::size_t& x, const std::size_t& y) const
+        {
+            return pixelbfr + CalculatePixelIndex(x, y);
+        }
+
+        // Sets a pixels color
+        // If using RGBA, use all
+        // If using RGB, a gets ignored
+        // If using BW, use only r
+        // BGR and BGRA work the same, the channels just get stored the other way round
+        void SetPixel(const std::size_t& x, const std::size_t& y, const byte& r, const byte& g = 0, const byte& b = 0, const byte& a = 0)
+        {
+            EncodePixel(GetPixel(x, y), colorMode, r, g, b, a);
+            return;
+        }
+
+        // Will set every pixel of the rectangle at x, y (from the top left) of size rectWidth x rectHeight to a color, like SetPixel() does.
+        // The rectangle gets clipped to the image
+        void FillRect(const std::size_t& x, const std::size_t& y, const std::size_t& rectWidth, const std::size_t& rectHeight, const byte& r, const byte& g = 0, const byte& b = 0, const byte& a = 0)
+        {
+            if ((!isInitialized) || (x >= width) || (y >= height))
+                return;
+
+            const std::size_t fillWidth = rectWidth < width - x ? rectWidth : width - x;
+            const std::size_t fillHeight = rectHeight < height - y ? rectHeight : height - y;
+            if ((!fillWidth) || (!fillHeight))
+                return;
+
+            byte px[4];
+            EncodePixel(px, colorMode, r, g, b, a);
+
+            // Whole rows lie back to back, so that's one go
+            if (fillWidth == width)
+            {
+                Kernels::FillPixels(pixelbfr + y * width * numChannelsPXBF, fillWidth * fillHeight, px, numChannelsPXBF);
+                return;
+            }
+
+            // The first row gets filled, the others are copies of it
+            byte* firstRow = pixelbfr + (y * width + x) * numChannelsPXBF;
+            Kernels::FillPixels(firstRow, fillWidth, px, numChannelsPXBF);
+            for (std::size_t i = 1; i < fillHeight; i++)
+                memcpy(firstRow + i * width * numChannelsPXBF, firstRow, fillWidth * numChannelsPXBF);
+
+            return;
+        }
+
+        // Will copy the rectangle at srcX, srcY (from the top left) of size rectWidth x rectHeight of source to dstX, dstY of this image.
+        // source may have a different color mode, its pixels then get converted on the way, just like ConvertTo() would.
+        // mirror copies it left to right, flip upside down. source may be this image, overlapping rectangles are fine.
+        // The rectangle gets clipped to both images. Returns false if nothing is left of it
+        bool CopyRect(const BMP& source, const std::size_t& srcX, const std::size_t& srcY, const std::size_t& rectWidth, const std::size_t& rectHeight, const std::size_t& dstX, const std::size_t& dstY, const bool mirror = false, const bool flip = false)
+        {
+            if ((!isInitialized) || (!source.isInitialized) ||
+                (srcX >= source.width) || (srcY >= source.height) || (dstX >= width) || (dstY >= height))
+                return false;
+
+            std::size_t copyWidth = rectWidth < source.width - srcX ? rectWidth : source.width - srcX;
+            std::size_t copyHeight = rectHeight < source.height - srcY ? rectHeight : source.height - srcY;
+            copyWidth = copyWidth < width - dstX ? copyWidth : width - dstX;
+            copyHeight = copyHeight < height - dstY ? copyHeight : height - dstY;
+            if ((!copyWidth) || (!copyHeight))
+                return false;
+
+            // Mirrored or flipped onto itself, rows or pixels would get overwritten before they got copied. So they get copied out of the way first
+            if ((&source == this) && (mirror || flip) &&
+                (srcX < dstX + copyWidth) && (dstX < srcX + copyWidth) && (srcY < dstY + copyHeight) && (dstY < srcY + copyHeight))
+            {
+                BMP temp(copyWidth, copyHeight, colorMode, false);
+                temp.CopyRect(*this, srcX, srcY, copyWidth, copyHeight, 0, 0);
+                return CopyRect(temp, 0, 0, copyWidth, copyHeight, dstX, dstY, mirror, flip);
+            }
+
+            const std::size_t srcChannels = source.numChannelsPXBF;
+            auto getSourceRow = [&](const std::size_t& i) { return source.pixelbfr + ((srcY + (flip ? copyHeight - 1 - i : i)) * source.width + srcX) * srcChannels; };
+            auto getDestinationRow = [&](const std::size_t& i) { return pixelbfr + ((dstY + i) * width + dstX) * numChannelsPXBF; };
+
+            // Same color mode, not mirrored. That's just moving rows around, or one block if they are whole rows of both
+            if ((source.colorMode == colorMode) && (!mirror))
+            {
+                if ((!flip) && (copyWidth == width) && (copyWidth == source.width))
+                {
+                    memmove(getDestinationRow(0), getSourceRow(0), copyWidth * copyHeight * numChannelsPXBF);
+                    return true;
+                }
+
+                // Copying onto itself further down, the rows have to go bottom to top, so none gets overwritten before it got copied
+                if ((&source == this) && (dstY > srcY))
+                {
+                    for (std::size_t i = copyHeight; i-- > 0;)
+                        memmove(getDestinationRow(i), getSourceRow(i), copyWidth * numChannelsPXBF);
+                }
+                else
+                {
+                    for (std::size_t i = 0; i < copyHeight; i++)
+                        memmove(getDestinationRow(i), getSourceRow(i), copyWidth * numChannelsPXBF);
+                }
+
+                return true;
+            }
+
+            // Mirrored and converted, that goes through one row of mirrored source pixels. Different color modes can't be the same image
+            std::vector<byte> mirrored((mirror) && (source.colorMode != colorMode) ? copyWidth * srcChannels : 0);
+            for (std::size_t i = 0; i < copyHeight; i++)
+            {
+                const byte* src = getSourceRow(i);
+                byte* dst = getDestinationRow(i);
+
+                if (!mirror)
+                    ConvertPixels(src, dst, copyWidth, source.colorMode, colorMode);
+                else if (source.colorMode == colorMode)
+                    Kernels::MirrorPixels(src, dst, copyWidth, numChannelsPXBF);
+                else
+                {
+                    Kernels::MirrorPixels(src, mirrored.data(), copyWidth, srcChannels);
+                    ConvertPixels(mirrored.data(), dst, copyWidth, source.colorMode, colorMode);
+                }
+            }
+
+            return true;
+        }
+
+        // Will return how many bytes Write() produces for this image. 0 if it isn't initialized.
+        // With run length encoding, this has to scan the whole image
+        std::size_t GetEncodedSize(const WriteOptions& options = WriteOptions()) const noexcept
+        {
+            if (!isInitialized)
+                return 0;
+
+            const BitmapHeader header = GetFileHeader(width, height, colorMode, options);
+            if (IsRunLengthEncoded(colorMode, options))
+                return header.offsetPixelArray + EncodeRle8(nullptr);
+
+            return header.offsetPixelArray + header.GetPaddedRowSize() * height;
+        }
+
+        // Will write a bmp image
+        bool Write(const std::string& filename, const WriteOptions& options = WriteOptions()) const
+        {
+            if (!isInitialized)
+                return false;
+
+            BMPLIB_INSTRUMENT_CALL(WRITE);
+            std::ofstream bs;
+            bs.open(filename, std::ofstream::binary);
+            if (!bs.good())
+                return false;
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+
+            const bool success = Write(bs, options);
+
+            bs.close();
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+            return success;
+        }
+
+        // Will write a bmp image to any stream, starting at its current position
+        bool Write(std::ostream& bs, const WriteOptions& options = WriteOptions()) const
+        {
+            if (!isInitialized)
+                return false;
+
+            if (IsRunLengthEncoded(colorMode, options))
+                return WriteRle(bs);
+
+            BMPLIB_INSTRUMENT_CALL(WRITE);
+            const BitmapHeader header = GetFileHeader(width, height, colorMode, options);
+            const std::size_t rowSize = width * header.bitDepth / 8;
+            const std::size_t paddedRowSize = header.GetPaddedRowSize();
+            const std::size_t paddingSize = paddedRowSize - rowSize; // number of padding bytes per scanline
+
+            byte headerData[maxHeaderSize];
+            EncodeFileHeader(header, headerData);
+            bs.write((const char*)headerData, header.offsetPixelArray);
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            // Nothing to encode, the rows of the pixel buffer go out as they are. Top-down without padding, that's all of them in one piece
+            if (IsPlainScanline(colorMode, options))
+            {
+                if ((header.IsTopDown()) && (!paddingSize))
+                    bs.write((const char*)pixelbfr, sizeofPxlbfr);
+                else
+                {
+                    const char padding[4] = { 0x69, 0x69, 0x69, 0x69 }; // dummy-data for padding
+                    for (std::size_t fileRow = 0; fileRow < height; fileRow++)
+                    {
+                        bs.write((const char*)pixelbfr + GetImageRow(fileRow, height, header.IsTopDown()) * rowSize, rowSize);
+                        bs.write(padding, paddingSize);
+                    }
+                }
+
+                bs.flush();
+                BMPLIB_INSTRUMENT_LAP(IO, height * paddedRowSize);
+                return bs.good();
+            }
+
+            // One scanline gets assembled at a time and handed straight to the stream.
+            // With a thread pool, it's a whole band of scanlines, encoded in parallel
+            const std::size_t rowsPerBand = GetRowsPerBand(paddedRowSize);
+            byte* scanlines;
+            try
+            {
+                scanlines = new byte[rowsPerBand * paddedRowSize];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            for (std::size_t i = 0; i < rowsPerBand; i++)
+                memset(scanlines + i * paddedRowSize + rowSize, 0x69, paddingSize); // dummy-data for padding
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, rowsPerBand * paddedRowSize);
+
+            for (std::size_t fileRow = 0; fileRow < height; fileRow += rowsPerBand)
+            {
+                const std::size_t numRows = rowsPerBand < height - fileRow ? rowsPerBand : height - fileRow;
+                ForEachRow(numRows, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+                {
+                    for (std::size_t i = begin; i < end; i++)
+                    {
+                        const std::size_t y = GetImageRow(fileRow + i, height, header.IsTopDown());
+                        EncodeScanline(pixelbfr + y * width * numChannelsPXBF, scanlines + i * paddedRowSize, width, y, colorMode, options);
+                    }
+                });
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, numRows * width * numChannelsPXBF);
+
+                bs.write((const char*)scanlines, numRows * paddedRowSize);
+                BMPLIB_INSTRUMENT_LAP(IO, numRows * paddedRowSize);
+            }
+
+            delete[] scanlines;
+
+            bs.flush();
+            BMPLIB_INSTRUMENT_LAP(IO, 0);
+            return bs.good();
+        }
+
+        // Will write a bmp image straight into buffer, which has to be at least GetEncodedSize() bytes long.
+        // Returns false (and leaves buffer alone) if it isn't
+        bool Write(byte* buffer, const std::size_t& bufferSize, const WriteOptions& options = WriteOptions()) const
+        {
+            if ((!isInitialized) || (bufferSize < GetEncodedSize(options)))
+                return false;
+
+            BMPLIB_INSTRUMENT_CALL(WRITE);
+            if (IsRunLengthEncoded(colorMode, options))
+            {
+                const BitmapHeader header = GetRleFileHeader();
+                EncodeFileHeader(header, buffer);
+                BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+                EncodeRle8(buffer + header.offsetPixelArray);
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+                return true;
+            }
+
+            const BitmapHeader header = GetFileHeader(width, height, colorMode, options);
+            const std::size_t rowSize = width * header.bitDepth / 8;
+            const std::size_t paddedRowSize = header.GetPaddedRowSize();
+            const std::size_t paddingSize = paddedRowSize - rowSize;
+
+            EncodeFileHeader(header, buffer);
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            // No scanline buffer needed, every row goes right where it belongs
+            byte* pixelArray = buffer + header.offsetPixelArray;
+            ForEachRow(height, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+            {
+                for (std::size_t fileRow = begin; fileRow < end; fileRow++)
+                {
+                    byte* scanline = pixelArray + fileRow * paddedRowSize;
+                    const std::size_t y = GetImageRow(fileRow, height, header.IsTopDown());
+                    EncodeScanline(pixelbfr + y * width * numChannelsPXBF, scanline, width, y, colorMode, options);
+                    memset(scanline + rowSize, 0x69, paddingSize); // dummy-data for padding
+                }
+            });
+            BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+
+            return true;
+        }
+
+        // Will read a bmp image
+        bool Read(std::string filename, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            std::ifstream bs;
+            bs.open(filename, std::ifstream::binary);
+            if (!bs.good())
+                return false;
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+
+            const bool success = Read(bs, options);
+
+            bs.close();
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+            return success;
+        }
+
+        // Will read a bmp image from any stream, starting at its current position.
+        // Only reads forward, so pipes and sockets work too. If the image gets cut off, this returns false and leaves the BMP uninitialized
+        bool Read(std::istream& bs, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            if (!IsValidDownscale(options.downscale))
+                return false;
+
+            // Both headers come in one go
+            byte headerData[maxHeaderSize];
+            if (!bs.read((char*)headerData, BitmapHeader::size))
+                return false;
+
+            BitmapHeader header;
+            if (!ParseFileHeader(headerData, header))
+                return false;
+
+            // Then the palette, if there is one. Then go to the beginning of the pixel array
+            const std::size_t headerEnd = GetHeaderEnd(header);
+            if ((!bs.read((char*)headerData + BitmapHeader::size, headerEnd - BitmapHeader::size)) || (!bs.ignore(header.offsetPixelArray - headerEnd)))
+                return false;
+
+            FileFormat format;
+            GetFileFormat(header, headerData, format, options);
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            if (IsRunLengthEncoded(header))
+            {
+                // No telling where the rows are before decoding, so the whole pixel array comes in first.
+                // Some files don't say how big it is, in which case it's everything up to the end of the stream
+                const std::size_t expected = header.sizeofPixelArray ? (std::size_t)header.sizeofPixelArray : ~(std::size_t)0;
+                std::vector<byte> pixelArray;
+                while ((pixelArray.size() < expected) && (bs.good()))
+                {
+                    const std::size_t chunkSize = expected - pixelArray.size() < ((std::size_t)1 << 16) ? expected - pixelArray.size() : ((std::size_t)1 << 16);
+                    const std::size_t got = pixelArray.size();
+                    pixelArray.resize(got + chunkSize);
+                    bs.read((char*)pixelArray.data() + got, chunkSize);
+                    pixelArray.resize(got + (std::size_t)bs.gcount());
+                }
+                BMPLIB_INSTRUMENT_LAP(IO, pixelArray.size());
+
+                ReInitialize(header.imgWidth, header.GetHeight(), format.colorMode, false);
+                BMPLIB_INSTRUMENT_LAP(ALLOCATE, 0);
+
+                const bool success = DecodeRle(pixelArray.data(), pixelArray.size(), format);
+                if (!success)
+                {
+                    // Half an image is no image
+                    ReleasePixelBuffer();
+                    return false;
+                }
+                ShrinkPixelBuffer(options.downscale);
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+                return success;
+            }
+
+            // Calculate scanline padding size
+            const std::size_t rowSize = format.rowSize;
+            const std::size_t paddedRowSize = format.paddedRowSize;
+            const std::size_t paddingSize = paddedRowSize - rowSize;
+
+            if (options.downscale != 1)
+            {
+                byte* scanline;
+                try
+                {
+                    scanline = new byte[paddedRowSize];
+                }
+                catch (std::bad_alloc& e)
+                {
+                    // too bad!
+                    ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                    return false; // This won't ever be reached but it satisfies the compiler, soooo...
+                }
+
+                const bool success = DecodeDownscaled(format, options.downscale, [&](const std::size_t&) -> const byte*
+                {
+                    bs.read((char*)scanline, paddedRowSize);
+                    BMPLIB_INSTRUMENT_LAP(IO, (std::size_t)bs.gcount());
+                    return (std::size_t)bs.gcount() < rowSize ? nullptr : scanline; // Don't insist on the padding of the very last scanline
+                });
+
+                delete[] scanline;
+                return success;
+            }
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize(header.imgWidth, header.GetHeight(), format.colorMode, false);
+
+            // Nothing to decode, the scanlines go straight into the pixel buffer. Top-down without padding, that's all of them in one piece
+            if (IsPlainScanline(format))
+            {
+                if ((header.IsTopDown()) && (!paddingSize))
+                {
+                    bs.read((char*)pixelbfr, sizeofPxlbfr);
+                    BMPLIB_INSTRUMENT_LAP(IO, (std::size_t)bs.gcount());
+                    if ((std::size_t)bs.gcount() != sizeofPxlbfr)
+                    {
+                        ReleasePixelBuffer();
+                        return false;
+                    }
+                    return true;
+                }
+
+                for (std::size_t fileRow = 0; fileRow < height; fileRow++)
+                {
+                    // Don't insist on the padding of the very last scanline
+                    if ((!bs.read((char*)pixelbfr + GetImageRow(fileRow, height, header.IsTopDown()) * rowSize, rowSize)) ||
+                        ((fileRow + 1 < height) && (!bs.ignore(paddingSize))))
+                    {
+                        ReleasePixelBuffer();
+                        return false;
+                    }
+                }
+                BMPLIB_INSTRUMENT_LAP(IO, height * paddedRowSize);
+                return true;
+            }
+
+            // Every scanline, including its padding, gets read in one go.
+            // With a thread pool, it's a whole band of scanlines, decoded in parallel
+            const std::size_t rowsPerBand = GetRowsPerBand(paddedRowSize);
+            byte* scanlines;
+            try
+            {
+                scanlines = new byte[rowsPerBand * paddedRowSize];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ReleasePixelBuffer();
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, rowsPerBand * paddedRowSize);
+
+            bool success = true;
+            for (std::size_t fileRow = 0; fileRow < height; fileRow += rowsPerBand)
+            {
+                const std::size_t numRows = rowsPerBand < height - fileRow ? rowsPerBand : height - fileRow;
+                bs.read((char*)scanlines, numRows * paddedRowSize);
+                BMPLIB_INSTRUMENT_LAP(IO, (std::size_t)bs.gcount());
+                if ((std::size_t)bs.gcount() < numRows * paddedRowSize - paddingSize) // Don't insist on the padding of the very last scanline
+                {
+                    success = false;
+                    break;
+                }
+
+                ForEachRow(numRows, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+                {
+                    for (std::size_t i = begin; i < end; i++)
+                        DecodeScanline(scanlines + i * paddedRowSize, pixelbfr + GetImageRow(fileRow + i, height, header.IsTopDown()) * width * numChannelsPXBF, width, format);
+                });
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, numRows * width * numChannelsPXBF);
+            }
+
+            delete[] scanlines;
+            if (!success)
+                ReleasePixelBuffer();
+            return success;
+        }
+
+        // Will read a bmp image straight out of data, without copying it anywhere first
+        bool Read(const byte* data, const std::size_t& dataSize, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            if ((!data) || (dataSize < BitmapHeader::size) || (!IsValidDownscale(options.downscale)))
+                return false;
+
+            BitmapHeader header;
+            if ((!ParseFileHeader(data, header)) || (header.offsetPixelArray > dataSize))
+                return false;
+
+            FileFormat format;
+            GetFileFormat(header, data, format, options);
+
+            if (IsRunLengthEncoded(header))
+            {
+                // Whatever the header says, the pixel array can't go past the end of data
+                const std::size_t available = dataSize - header.offsetPixelArray;
+                const std::size_t pixelArraySize = (header.sizeofPixelArray) && (header.sizeofPixelArray < available) ? (std::size_t)header.sizeofPixelArray : available;
+                BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+                ReInitialize(header.imgWidth, header.GetHeight(), format.colorMode, false);
+                const bool success = DecodeRle(data + header.offsetPixelArray, pixelArraySize, format);
+                if (!success)
+                {
+                    // Half an image is no image
+                    ReleasePixelBuffer();
+                    return false;
+                }
+                ShrinkPixelBuffer(options.downscale);
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+                return success;
+            }
+
+            // Check that the whole pixel array is there, before allocating anything for it. The very last scanline may come without its padding
+            const std::size_t rowSize = format.rowSize;
+            const std::size_t paddedRowSize = format.paddedRowSize;
+            const std::size_t available = dataSize - header.offsetPixelArray;
+            if ((available < rowSize) || ((header.GetHeight() - 1) > (available - rowSize) / paddedRowSize))
+                return false;
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            if (options.downscale != 1)
+            {
+                const bool success = DecodeDownscaled(format, options.downscale, [&](const std::size_t& fileRow) -> const byte*
+                {
+                    return data + header.offsetPixelArray + fileRow * paddedRowSize;
+                });
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+                return success;
+            }
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize(header.imgWidth, header.GetHeight(), format.colorMode, false);
+
+            const byte* pixelArray = data + header.offsetPixelArray;
+            ForEachRow(height, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+            {
+                for (std::size_t fileRow = begin; fileRow < end; fileRow++)
+                    DecodeScanline(pixelArray + fileRow * paddedRowSize, pixelbfr + GetImageRow(fileRow, height, header.IsTopDown()) * width * numChannelsPXBF, width, format);
+            });
+            BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+
+            return true;
+        }
+
+        // Will read only the rectangle at (x, y) (from the top left) of size cropWidth x cropHeight out of a bmp image. It gets clipped to the image, and the BMP ends up that size.
+        // Only the scanlines the rectangle covers get read, and only the bytes of them it covers, so this costs as much as the rectangle, not the image.
+        // Returns false if the rectangle lies outside of the image. Run length encoded images are the exception, they have to be decoded whole first
+        bool Read(const std::string& filename, const std::size_t& x, const std::size_t& y, const std::size_t& cropWidth, const std::size_t& cropHeight, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            std::ifstream bs;
+            bs.open(filename, std::ifstream::binary);
+            if (!bs.good())
+                return false;
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+
+            const bool success = Read(bs, x, y, cropWidth, cropHeight, options);
+
+            bs.close();
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+            return success;
+        }
+
+        // Same as above, from any stream that can seek. The image has to start at its current position
+        bool Read(std::istream& bs, const std::size_t& x, const std::size_t& y, const std::size_t& cropWidth, const std::size_t& cropHeight, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            const std::streampos start = bs.tellg();
+            if ((start == std::streampos(-1)) || (options.downscale != 1))
+                return false;
+
+            // Headers and palette, just like Read()
+            byte headerData[maxHeaderSize];
+            BitmapHeader header;
+            if ((!bs.read((char*)headerData, BitmapHeader::size)) ||
+                (!ParseFileHeader(headerData, header)) ||
+                (!bs.read((char*)headerData + BitmapHeader::size, GetHeaderEnd(header) - BitmapHeader::size)))
+                return false;
+
+            FileFormat format;
+            GetFileFormat(header, headerData, format, options);
+            BMPLIB_INSTRUMENT_LAP(HEADER, GetHeaderEnd(header));
+
+            Region region;
+            if (!GetRegion(format, x, y, cropWidth, cropHeight, region))
+                return false;
+
+            if (IsRunLengthEncoded(header))
+            {
+                BMP whole(allocator);
+                bs.seekg(start);
+                if (!whole.Read(bs, options))
+                    return false;
+
+                CutRegion(whole, region);
+                return true;
+            }
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize(region.width, region.height, format.colorMode, false);
+
+            // Scanlines that are rows of the pixel buffer already get read right where they belong, the others into scanline first
+            const bool isPlain = (IsPlainScanline(format)) && (!region.skipPixels);
+            byte* scanline;
+            try
+            {
+                scanline = new byte[region.numBytes];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ReleasePixelBuffer();
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, region.numBytes);
+
+            // Front to back through the file, so the drive doesn't have to jump around more than it has to
+            bool success = true;
+            for (std::size_t fileRow = region.firstFileRow; fileRow < region.firstFileRow + region.height; fileRow++)
+            {
+                byte* dst = pixelbfr + (GetImageRow(fileRow, header.GetHeight(), header.IsTopDown()) - region.y) * width * numChannelsPXBF;
+                byte* src = isPlain ? dst : scanline;
+
+                bs.seekg(start + (std::streamoff)(header.offsetPixelArray + fileRow * format.paddedRowSize + region.firstByte));
+                if (!bs.read((char*)src, region.numBytes))
+                {
+                    success = false;
+                    break;
+                }
+                BMPLIB_INSTRUMENT_LAP(IO, region.numBytes);
+
+                if (!isPlain)
+                    DecodeRegionScanline(src, dst, region, format);
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, width * numChannelsPXBF);
+            }
+
+            delete[] scanline;
+            if (!success)
+                ReleasePixelBuffer();
+            return success;
+        }
+
+        // Same as above, straight out of data
+        bool Read(const byte* data, const std::size_t& dataSize, const std::size_t& x, const std::size_t& y, const std::size_t& cropWidth, const std::size_t& cropHeight, const ReadOptions& options = ReadOptions())
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            if ((!data) || (dataSize < BitmapHeader::size) || (options.downscale != 1))
+                return false;
+
+            BitmapHeader header;
+            if ((!ParseFileHeader(data, header)) || (header.offsetPixelArray > dataSize))
+                return false;
+
+            FileFormat format;
+            GetFileFormat(header, data, format, options);
+
+            Region region;
+            if (!GetRegion(format, x, y, cropWidth, cropHeight, region))
+                return false;
+
+            if (IsRunLengthEncoded(header))
+            {
+                BMP whole(allocator);
+                if (!whole.Read(data, dataSize, options))
+                    return false;
+
+                CutRegion(whole, region);
+                return true;
+            }
+
+            // Check that every byte the rectangle covers is there, before allocating anything for it
+            const std::size_t available = dataSize - header.offsetPixelArray;
+            const std::size_t lastFileRow = region.firstFileRow + region.height - 1;
+            if ((available < region.firstByte + region.numBytes) || (lastFileRow > (available - region.firstByte - region.numBytes) / format.paddedRowSize))
+                return false;
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize(region.width, region.height, format.colorMode, false);
+
+            const byte* pixelArray = data + header.offsetPixelArray + region.firstByte;
+            ForEachRow(region.height, region.numBytes, [&](const std::size_t& begin, const std::size_t& end)
+            {
+                for (std::size_t i = begin; i < end; i++)
+                {
+                    const std::size_t fileRow = region.firstFileRow + i;
+                    byte* dst = pixelbfr + (GetImageRow(fileRow, header.GetHeight(), header.IsTopDown()) - region.y) * width * numChannelsPXBF;
+                    DecodeRegionScanline(pixelArray + fileRow * format.paddedRowSize, dst, region, format);
+                }
+            });
+            BMPLIB_INSTRUMENT_LAP(SWIZZLE, sizeofPxlbfr);
+
+            return true;
+        }
+
+        // Will write a bmp image in the background (on GetIoExecutor()), and return right away.
+        // Until the future is ready, this image has to stay alive and must not be changed. Looking at it is fine tho.
+        // Exceptions end up in the future
+        std::future<bool> WriteAsync(const std::string& filename, const WriteOptions& options = WriteOptions()) const
+        {
+            std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+            std::future<bool> future = promise->get_future();
+            GetIoExecutor().Submit([this, filename, options, promise]()
+            {
+                try
+                {
+                    promise->set_value(WriteOverlapped(filename, options));
+                }
+                catch (...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            });
+            return future;
+        }
+
+        // Same as above, but calls onDone(success) on the executor once it's done. An exception counts as success == false
+        void WriteAsync(const std::string& filename, std::function<void(bool)> onDone, const WriteOptions& options = WriteOptions()) const
+        {
+            GetIoExecutor().Submit([this, filename, onDone, options]()
+            {
+                bool success = false;
+                try
+                {
+                    success = WriteOverlapped(filename, options);
+                }
+                catch (...)
+                {
+                }
+
+                if (onDone)
+                    onDone(success);
+            });
+            return;
+        }
+
+        // Will read a bmp image in the background (on GetIoExecutor()), and return right away.
+        // Until the future is ready, this image has to stay alive, and you must not touch it at all, not even to look at it.
+        // Exceptions end up in the future
+        std::future<bool> ReadAsync(const std::string& filename, const ReadOptions& options = ReadOptions())
+        {
+            std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+            std::future<bool> future = promise->get_future();
+            GetIoExecutor().Submit([this, filename, options, promise]()
+            {
+                try
+                {
+                    promise->set_value(ReadOverlapped(filename, options));
+                }
+                catch (...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            });
+            return future;
+        }
+
+        // Same as above, but calls onDone(success) on the executor once it's done. An exception counts as success == false
+        void ReadAsync(const std::string& filename, std::function<void(bool)> onDone, const ReadOptions& options = ReadOptions())
+        {
+            GetIoExecutor().Submit([this, filename, onDone, options]()
+            {
+                bool success = false;
+                try
+                {
+                    success = ReadOverlapped(filename, options);
+                }
+                catch (...)
+                {
+                }
+
+                if (onDone)
+                    onDone(success);
+            });
+            return;
+        }
+
+        ~BMP()
+        {
+            if (isInitialized)
+            {
+                FreePixelMemory();
+                pixelbfr = nullptr;
+            }
+            return;
+        }
+
+    private:
+        friend class MappedBMP;
+        friend class BMPStreamReader;
+        friend class BMPStreamWriter;
+        template <COLOR_MODE, typename> friend class ImageView;
+        template <COLOR_MODE> friend class AlignedImage;
+
+        // Will hand the pixel buffer back to wherever it came from
+        void FreePixelMemory() noexcept
+        {
+            if (allocator)
+                allocator->Deallocate(pixelbfr, capacityPxlbfr);
+            else
+                free(pixelbfr);
+            return;
+        }
+
+        // Will free the pixel buffer and leave this image uninitialized
+        void ReleasePixelBuffer() noexcept
+        {
+            if (isInitialized)
+                FreePixelMemory();
+
+            width = 0;
+            height = 0;
+            pixelbfr = nullptr;
+            sizeofPxlbfr = 0;
+            capacityPxlbfr = 0;
+            isInitialized = false;
+            return;
+        }
+
+        // Will resize the allocation of the pixel buffer, keeping as much of its contents as fits
+        void ResizePixelBuffer(const std::size_t& size)
+        {
+            byte* resized = allocator ? allocator->Reallocate(pixelbfr, capacityPxlbfr, size) : (byte*)realloc(pixelbfr, size);
+            if (!resized)
+            {
+                // too bad! The old pixel buffer is still intact tho
+                ThrowException("Can't allocate memory for pixelbuffer!");
+            }
+
+            pixelbfr = resized;
+            capacityPxlbfr = size;
+            return;
+        }
+
+        // Bytes per pixel in the file format
+        static std::size_t GetNumChannelsFile(const COLOR_MODE& colorMode) noexcept
+        {
+            switch (colorMode)
+            {
+            case COLOR_MODE::BW:
+                return 1;
+            case COLOR_MODE::RGB:
+            case COLOR_MODE::BGR:
+                return 3;
+            default:
+                return 4;
+            }
+        }
+
+        // Num channels of the pixel buffer
+        static std::size_t GetNumChannelsPXBF(const COLOR_MODE& colorMode) noexcept
+        {
+            switch (colorMode)
+            {
+            case COLOR_MODE::BW:
+                return 1;
+            case COLOR_MODE::RGB:
+            case COLOR_MODE::BGR:
+                return 3;
+            default:
+                return 4;
+            }
+        }
+
+        // Whether the pixel buffer of colorMode has blue first
+        static bool IsBgrOrder(const COLOR_MODE& colorMode) noexcept
+        {
+            return (colorMode == COLOR_MODE::BGR) || (colorMode == COLOR_MODE::BGRA);
+        }
+
+        // Will return the color mode with the same channels as colorMode, but red first. BW stays BW
+        static COLOR_MODE GetRgbOrder(const COLOR_MODE& colorMode) noexcept
+        {
+            switch (colorMode)
+            {
+            case COLOR_MODE::BGR:
+                return COLOR_MODE::RGB;
+            case COLOR_MODE::BGRA:
+                return COLOR_MODE::RGBA;
+            default:
+                return colorMode;
+            }
+        }
+
+        // Will swap red and blue of numPx pixels of colorMode in place
+        static void SwapRB(byte* px, const std::size_t& numPx, const COLOR_MODE& colorMode) noexcept
+        {
+            if (GetNumChannelsPXBF(colorMode) == 3)
+                Kernels::SwapRB24(px, px, numPx);
+            else if (GetNumChannelsPXBF(colorMode) == 4)
+                Kernels::SwapRB32(px, px, numPx);
+
+            return;
+        }
+
+        // Everything it takes to decode the pixel array of a bmp file, besides the pixel array itself
+        struct FileFormat
+        {
+            BitmapHeader header;
+            COLOR_MODE colorMode;      // what the pixel array decodes to
+            std::size_t rowSize;       // bytes per scanline in the file, without padding
+            std::size_t paddedRowSize; // bytes per scanline in the file, with padding
+            bool isIdentityPalette;    // palette entry i is (i, i, i), so palette indices are gray values already
+            byte palette[256 * 3];     // R-G-B (or B-G-R, if colorMode is BGR) per palette entry, for indexed images
+            byte4 masks[4];            // R-G-B-A bit masks, for 16 and 32 bit images. A channel without mask is 0, or 255 for alpha
+            byte maskShifts[4];        // where the lowest bit of each mask is
+            byte maskBits[4];          // how many bits each mask has
+        };
+
+        // Where a rectangle of the image lies in the pixel array
+        struct Region
+        {
+            std::size_t x;            // rectangle in pixels, from the top left, clipped to the image
+            std::size_t y;
+            std::size_t width;
+            std::size_t height;
+            std::size_t firstFileRow; // first scanline in the file the rectangle covers. It covers height of them, back to back
+            std::size_t firstByte;    // where in a scanline the bytes of the rectangle start
+            std::size_t numBytes;     // how many bytes of a scanline the rectangle covers
+            std::size_t skipPixels;   // pixels at the start of those bytes that don't belong to the rectangle. Only ever 1, for 4 bit images at odd x
+        };
+
+        // Will find out which bytes of the pixel array the rectangle at (x, y) of size width x height covers, clipped to the image. Returns false if nothing of it is left
+        static bool GetRegion(const FileFormat& format, const std::size_t& x, const std::size_t& y, const std::size_t& width, const std::size_t& height, Region& region) noexcept
+        {
+            const std::size_t imgWidth = format.header.imgWidth;
+            const std::size_t imgHeight = format.header.GetHeight();
+            if ((x >= imgWidth) || (y >= imgHeight) || (!width) || (!height))
+                return false;
+
+            region.x = x;
+            region.y = y;
+            region.width = width < imgWidth - x ? width : imgWidth - x;
+            region.height = height < imgHeight - y ? height : imgHeight - y;
+
+            // Dumbass unusual pixel order of bmp made me do this...
+            region.firstFileRow = format.header.IsTopDown() ? y : imgHeight - y - region.height;
+
+            const std::size_t bitDepth = format.header.bitDepth;
+            region.firstByte = x * bitDepth / 8;
+            region.numBytes = ((x + region.width) * bitDepth + 7) / 8 - region.firstByte;
+            region.skipPixels = (x * bitDepth % 8) / bitDepth;
+
+            return true;
+        }
+
+        // Will decode the bytes of one scanline that region covers (src points to the first of them) into one row of the pixel buffer
+        static void DecodeRegionScanline(const byte* src, byte* dst, const Region& region, const FileFormat& format) noexcept
+        {
+            if (!region.skipPixels)
+            {
+                DecodeScanline(src, dst, region.width, format);
+                return;
+            }
+
+            // Only 4 bit images get here, with the rectangle starting at the low nibble of the first byte
+            const std::size_t numChannels = GetNumChannelsPXBF(format.colorMode);
+            for (std::size_t x = 0; x < region.width; x++)
+            {
+                const std::size_t nibble = x + 1;
+                const byte* entry = format.palette + ((src[nibble / 2] >> (nibble % 2 ? 0 : 4)) & 0x0F) * 3;
+                memcpy(dst + x * numChannels, entry, numChannels);
+            }
+
+            return;
+        }
+
+        // Will write one pixel of colorMode to px, with the channels where SetPixel() puts them
+        static void EncodePixel(byte* px, const COLOR_MODE& colorMode, const byte& r, const byte& g, const byte& b, const byte& a) noexcept
+        {
+            switch (colorMode)
+            {
+            case COLOR_MODE::BW:
+                px[0] = r;
+                break;
+
+            case COLOR_MODE::RGB:
+                px[0] = r;
+                px[1] = g;
+                px[2] = b;
+                break;
+
+            case COLOR_MODE::RGBA:
+                px[0] = r;
+                px[1] = g;
+                px[2] = b;
+                px[3] = a;
+                break;
+
+            case COLOR_MODE::BGR:
+                px[0] = b;
+                px[1] = g;
+                px[2] = r;
+                break;
+
+            case COLOR_MODE::BGRA:
+                px[0] = b;
+                px[1] = g;
+                px[2] = r;
+                px[3] = a;
+                break;
+            }
+
+            return;
+        }
+
+        // Will convert numPx pixels of src (in color mode from) to to, into dst. Same as ConvertTo(), but for any two separate buffers
+        static void ConvertPixels(const byte* src, byte* dst, const std::size_t& numPx, const COLOR_MODE& from, const COLOR_MODE& to) noexcept
+        {
+            if (from == to)
+            {
+                memcpy(dst, src, numPx * GetNumChannelsPXBF(to));
+                return;
+            }
+
+            // BGR and BGRA convert just like RGB and RGBA, with red and blue swapped afterwards, or weighted the other way round for BW
+            const COLOR_MODE fromOrder = GetRgbOrder(from);
+            const COLOR_MODE toOrder = GetRgbOrder(to);
+            Kernels::GrayWeights grayWeights = Kernels::grayWeightsColor;
+            if (IsBgrOrder(from))
+                std::swap(grayWeights.r, grayWeights.b);
+
+            switch (fromOrder)
+            {
+            case COLOR_MODE::BW:
+                if (toOrder == COLOR_MODE::RGB)
+                    Kernels::GrayToRgb24(src, dst, numPx);
+                else
+                    Kernels::GrayToRgba32(src, dst, numPx);
+                return;
+
+            case COLOR_MODE::RGB:
+                if (toOrder == COLOR_MODE::BW)
+                    Kernels::Rgb24ToGray(src, dst, numPx, grayWeights);
+                else if (toOrder == COLOR_MODE::RGB)
+                    Kernels::SwapRB24(src, dst, numPx); // RGB <-> BGR, nothing left to swap afterwards
+                else
+                    Kernels::Rgb24ToRgba32(src, dst, numPx);
+                break;
+
+            default:
+                if (toOrder == COLOR_MODE::BW)
+                    Kernels::Rgba32ToGray(src, dst, numPx, grayWeights);
+                else if (toOrder == COLOR_MODE::RGB)
+                    Kernels::Rgba32ToRgb24(src, dst, numPx);
+                else
+                    Kernels::SwapRB32(src, dst, numPx); // RGBA <-> BGRA
+                break;
+            }
+
+            if ((fromOrder != toOrder) && (toOrder != COLOR_MODE::BW) && (IsBgrOrder(from) != IsBgrOrder(to)))
+                SwapRB(dst, numPx, to);
+
+            return;
+        }
+
+        // Whether Read() can shrink images by factor
+        static bool IsValidDownscale(const std::size_t& factor) noexcept
+        {
+            return (factor == 1) || (factor == 2) || (factor == 4) || (factor == 8);
+        }
+
+        // Will average every factor columns of sums, rounding to the nearest value. The last block of the row can be narrower.
+        // divide(sum) has to do it for a block of factor x numRows
+        template <std::size_t numChannels, std::size_t factor, typename Divide>
+        static void AverageBlocks(const byte2* sums, byte* dst, const std::size_t& width, const std::size_t& numRows, const Divide& divide) noexcept
+        {
+            const std::size_t numBlocks = width / factor;
+            for (std::size_t i = 0; i < numBlocks; i++, sums += factor * numChannels, dst += numChannels)
+                for (std::size_t c = 0; c < numChannels; c++)
+                {
+                    byte2 sum = 0;
+                    for (std::size_t x = 0; x < factor; x++)
+                        sum += sums[x * numChannels + c];
+                    dst[c] = divide(sum);
+                }
+
+            const std::size_t rest = width % factor;
+            if (rest)
+                for (std::size_t c = 0; c < numChannels; c++)
+                {
+                    byte2 sum = 0;
+                    for (std::size_t x = 0; x < rest; x++)
+                        sum += sums[x * numChannels + c];
+                    dst[c] = (byte)((sum + rest * numRows / 2) / (rest * numRows));
+                }
+
+            return;
+        }
+
+        template <std::size_t numChannels, std::size_t factor>
+        static void AverageBlocks(const byte2* sums, byte* dst, const std::size_t& width, const std::size_t& numRows) noexcept
+        {
+            // Full blocks divide by a power of two the compiler knows about. Way faster than a real division
+            if (numRows == factor)
+                AverageBlocks<numChannels, factor>(sums, dst, width, numRows, [](const byte2& sum) { return (byte)((sum + factor * factor / 2) / (factor * factor)); });
+            else
+                AverageBlocks<numChannels, factor>(sums, dst, width, numRows, [&numRows](const byte2& sum) { return (byte)((sum + factor * numRows / 2) / (factor * numRows)); });
+
+            return;
+        }
+
+        template <std::size_t factor>
+        static void AverageBlocks(const byte2* sums, byte* dst, const std::size_t& width, const std::size_t& numChannels, const std::size_t& numRows) noexcept
+        {
+            switch (numChannels)
+            {
+            case 1:
+                AverageBlocks<1, factor>(sums, dst, width, numRows);
+                break;
+            case 3:
+                AverageBlocks<3, factor>(sums, dst, width, numRows);
+                break;
+            default:
+                AverageBlocks<4, factor>(sums, dst, width, numRows);
+                break;
+            }
+
+            return;
+        }
+
+        // Will turn a row of sums (numRows scanlines of width pixels added up) into one row of factor x factor block averages
+        static void AverageBlocks(const byte2* sums, byte* dst, const std::size_t& width, const std::size_t& numChannels, const std::size_t& factor, const std::size_t& numRows) noexcept
+        {
+            switch (factor)
+            {
+            case 2:
+                AverageBlocks<2>(sums, dst, width, numChannels, numRows);
+                break;
+            case 4:
+                AverageBlocks<4>(sums, dst, width, numChannels, numRows);
+                break;
+            default:
+                AverageBlocks<8>(sums, dst, width, numChannels, numRows);
+                break;
+            }
+
+            return;
+        }
+
+        // Biggest header (with palette) we can make sense of: file header, BITMAPV5HEADER, 256 palette entries
+        static constexpr std::size_t maxHeaderSize = 14 + 124 + 256 * 4;
+
+        // Whether Write() run length encodes the pixel array of an image like this
+        static bool IsRunLengthEncoded(const COLOR_MODE& colorMode, const WriteOptions& options) noexcept
+        {
+            return (options.rle) && (colorMode == COLOR_MODE::BW);
+        }
+
+        // Whether Write() packs an image like this into 16 bit
+        static bool IsHighColor(const COLOR_MODE& colorMode, const WriteOptions& options) noexcept
+        {
+            return (options.highColor != WriteOptions::HIGH_COLOR::NONE) && (colorMode != COLOR_MODE::BW);
+        }
+
+        // Will fill in the headers Write puts in front of a run length encoded pixel array. This is where the image gets scanned, to know how large that gets
+        BitmapHeader GetRleFileHeader() const noexcept
+        {
+            BitmapHeader header = GetFileHeader(width, height, colorMode);
+            header.compression = 1;
+            header.sizeofPixelArray = byte4(EncodeRle8(nullptr));
+            header.fileSize = byte4(header.offsetPixelArray + header.sizeofPixelArray);
+
+            return header;
+        }
+
+        // Will fill in the headers Write puts in front of the pixel array. Run length encoding is up to GetRleFileHeader()
+        static BitmapHeader GetFileHeader(const std::size_t& width, const std::size_t& height, const COLOR_MODE& colorMode, const WriteOptions& options = WriteOptions()) noexcept
+        {
+            BitmapHeader header;
+            header.imgWidth = byte4(width);
+            header.imgHeight = options.topDown ? 0u - byte4(height) : byte4(height);
+            header.bitDepth = byte2(GetNumChannelsFile(colorMode) * 8);
+
+            // BW images get stored as 8 bit, with a palette that maps every value to itself in gray
+            if (colorMode == COLOR_MODE::BW)
+            {
+                header.colorsInPalette = 256;
+                header.offsetPixelArray = byte4(BitmapHeader::size + 256 * 4);
+            }
+
+            // 555 is what 16 bit means without any masks. 565 needs its masks right behind the header
+            if (IsHighColor(colorMode, options))
+            {
+                header.bitDepth = 16;
+                if (options.highColor == WriteOptions::HIGH_COLOR::RGB565)
+                {
+                    header.compression = 3;
+                    header.offsetPixelArray = byte4(BitmapHeader::size + 3 * 4);
+                }
+            }
+
+            header.sizeofPixelArray = byte4(header.GetPaddedRowSize() * height);
+            header.fileSize = byte4(header.offsetPixelArray + header.sizeofPixelArray);
+
+            return header;
+        }
+
+        // Will write header and the palette or masks (if any) to dst. That's header.offsetPixelArray bytes, at most maxHeaderSize
+        static void EncodeFileHeader(const BitmapHeader& header, byte* dst) noexcept
+        {
+            header.Encode(dst);
+
+            // The only bitfields we write are the ones of RGB565
+            if (header.compression == 3)
+            {
+                byte* masks = dst + BitmapHeader::size;
+                masks = ToBytes((byte4)0xF800, masks);
+                masks = ToBytes((byte4)0x07E0, masks);
+                ToBytes((byte4)0x001F, masks);
+            }
+
+            if (header.colorsInPalette)
+            {
+                byte* entry = dst + BitmapHeader::size;
+                for (std::size_t i = 0; i < header.colorsInPalette; i++, entry += 4)
+                {
+                    // B-G-R-unused
+                    entry[0] = entry[1] = entry[2] = (byte)i;
+                    entry[3] = 0;
+                }
+            }
+
+            return;
+        }
+
+        // Will decode the 54 header bytes at data, and check that it's something we can read
+        static bool ParseFileHeader(const byte* data, BitmapHeader& header) noexcept
+        {
+            // Check BMP signature
+            if (!header.Decode(data))
+                return false;
+
+            if ((!header.imgWidth) || (!header.imgHeight) || (header.dibHeadLen < 40) || (header.offsetPixelArray < BitmapHeader::size))
+                return false;
+
+            // Uncompressed, run length encoded (RLE8 for 8 bit, RLE4 for 4 bit, never top-down), or bitfields (with or without alpha mask).
+            // 24 bit images with bitfields are just read as usual
+            switch (header.compression)
+            {
+            case 0:
+                break;
+            case 1:
+                if ((header.bitDepth != 8) || (header.IsTopDown()))
+                    return false;
+                break;
+            case 2:
+                if ((header.bitDepth != 4) || (header.IsTopDown()))
+                    return false;
+                break;
+            case 3:
+            case 6:
+                if ((header.bitDepth != 16) && (header.bitDepth != 32) && ((header.bitDepth != 24) || (header.compression != 3)))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+
+            // Gather image bit-depth
+            switch (header.bitDepth)
+            {
+            case 4:
+            case 8:
+                return (header.colorsInPalette <= ((std::size_t)1 << header.bitDepth)) && (header.dibHeadLen <= 124) && (GetHeaderEnd(header) <= header.offsetPixelArray);
+            case 16:
+            case 32:
+                return (header.dibHeadLen <= 124) && (GetHeaderEnd(header) <= header.offsetPixelArray);
+            case 24:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Whether the channels of a 16 or 32 bit image are given by bit masks, right after the BITMAPINFOHEADER
+        static bool HasBitfields(const BitmapHeader& header) noexcept
+        {
+            return ((header.compression == 3) || (header.compression == 6)) && ((header.bitDepth == 16) || (header.bitDepth == 32));
+        }
+
+        // Whether the pixel array is run length encoded, instead of one scanline after another
+        static bool IsRunLengthEncoded(const BitmapHeader& header) noexcept
+        {
+            return (header.compression == 1) || (header.compression == 2);
+        }
+
+        // Will return which row of the image the scanline at fileRow holds
+        static std::size_t GetImageRow(const std::size_t& fileRow, const std::size_t& height, const bool& isTopDown) noexcept
+        {
+            // Dumbass unusual pixel order of bmp made me do this...
+            return isTopDown ? fileRow : height - 1 - fileRow;
+        }
+
+        // Whether a scanline of the file is byte for byte a row of the pixel buffer, so there's nothing to decode
+        static bool IsPlainScanline(const FileFormat& format) noexcept
+        {
+            switch (format.header.bitDepth)
+            {
+            case 8:
+                return (format.colorMode == COLOR_MODE::BW) && (format.isIdentityPalette);
+            case 24:
+                return format.colorMode == COLOR_MODE::BGR;
+            case 32:
+                return (format.colorMode == COLOR_MODE::BGRA) && (HasStandardMasks(format));
+            default:
+                return false;
+            }
+        }
+
+        // Whether Write() can take the rows of an image like this as they are, without encoding them
+        static bool IsPlainScanline(const COLOR_MODE& colorMode, const WriteOptions& options) noexcept
+        {
+            return (!IsHighColor(colorMode, options)) && ((colorMode == COLOR_MODE::BW) || (IsBgrOrder(colorMode)));
+        }
+
+        // How many bytes from the start of the file Read() has to look at before it gets to the pixels: the headers, and the palette if there is one
+        static std::size_t GetHeaderEnd(const BitmapHeader& header) noexcept
+        {
+            // The masks come right after the 40 bytes of the BITMAPINFOHEADER. Newer headers have them built in
+            if (HasBitfields(header))
+            {
+                const std::size_t masksEnd = 14 + 40 + (header.compression == 6 ? 4 : 3) * 4;
+                return masksEnd > 14 + header.dibHeadLen ? masksEnd : 14 + header.dibHeadLen;
+            }
+
+            if (header.bitDepth > 8)
+                return BitmapHeader::size;
+
+            const std::size_t numColors = header.colorsInPalette ? header.colorsInPalette : (std::size_t)1 << header.bitDepth;
+            return 14 + header.dibHeadLen + numColors * 4;
+        }
+
+        // Will find out how to decode the pixel array. data points to the start of the file, and has to be at least GetHeaderEnd(header) bytes long
+        static void GetFileFormat(const BitmapHeader& header, const byte* data, FileFormat& format, const ReadOptions& options) noexcept
+        {
+            format.header = header;
+            format.rowSize = ((std::size_t)header.imgWidth * header.bitDepth + 7) / 8;
+            format.paddedRowSize = header.GetPaddedRowSize();
+            format.isIdentityPalette = false;
+
+            switch (header.bitDepth)
+            {
+            case 4:
+            case 8:
+            {
+                // Palette entries are B-G-R-unused. Whatever isn't in the palette is black
+                const std::size_t numColors = header.colorsInPalette ? header.colorsInPalette : (std::size_t)1 << header.bitDepth;
+                const byte* entry = data + 14 + header.dibHeadLen;
+                memset(format.palette, 0, sizeof(format.palette));
+
+                // Indices past a short palette have to come out black, so only a full palette can be the identity
+                bool isGray = true;
+                format.isIdentityPalette = numColors == (std::size_t)1 << header.bitDepth;
+                for (std::size_t i = 0; i < numColors; i++, entry += 4)
+                {
+                    format.palette[i * 3 + 0] = options.bgr ? entry[0] : entry[2];
+                    format.palette[i * 3 + 1] = entry[1];
+                    format.palette[i * 3 + 2] = options.bgr ? entry[2] : entry[0];
+                    if ((entry[0] != entry[1]) || (entry[1] != entry[2]))
+                        isGray = false;
+                    if (entry[0] != i)
+                        format.isIdentityPalette = false;
+                }
+                format.isIdentityPalette = (format.isIdentityPalette) && (isGray);
+
+                // Gray palettes stay 1 channel, colorful ones get expanded to RGB
+                format.colorMode = isGray ? COLOR_MODE::BW : COLOR_MODE::RGB;
+                break;
+            }
+
+            case 16:
+            case 32:
+            {
+                // Without bitfields, 16 bit is X1-R5-G5-B5, and 32 bit is B-G-R-A
+                if (HasBitfields(header))
+                {
+                    const byte* masks = data + 14 + 40;
+                    for (std::size_t i = 0; i < 3; i++)
+                        FromBytes(masks + i * 4, format.masks[i]);
+
+                    // BITMAPINFOHEADER only brings an alpha mask with BI_ALPHABITFIELDS. The newer ones always have room for one.
+                    // Without either, the data may well end right after the blue mask
+                    if ((header.compression == 6) || (header.dibHeadLen >= 56))
+                        FromBytes(masks + 3 * 4, format.masks[3]);
+                    else
+                        format.masks[3] = 0;
+                }
+                else if (header.bitDepth == 16)
+                {
+                    format.masks[0] = 0x7C00;
+                    format.masks[1] = 0x03E0;
+                    format.masks[2] = 0x001F;
+                    format.masks[3] = 0;
+                }
+                else
+                {
+                    format.masks[0] = 0x00FF0000;
+                    format.masks[1] = 0x0000FF00;
+                    format.masks[2] = 0x000000FF;
+                    format.masks[3] = 0xFF000000;
+                }
+
+                for (std::size_t i = 0; i < 4; i++)
+                {
+                    // Bits outside the pixel can't be in there
+                    if (header.bitDepth == 16)
+                        format.masks[i] &= 0xFFFF;
+
+                    byte4 mask = format.masks[i];
+                    format.maskShifts[i] = 0;
+                    format.maskBits[i] = 0;
+                    while ((mask) && (!(mask & 1)))
+                    {
+                        mask >>= 1;
+                        format.maskShifts[i]++;
+                    }
+                    while (mask & 1)
+                    {
+                        mask >>= 1;
+                        format.maskBits[i]++;
+                    }
+                }
+
+                // No alpha mask, no alpha channel
+                format.colorMode = format.masks[3] ? COLOR_MODE::RGBA : COLOR_MODE::RGB;
+                break;
+            }
+
+            case 24:
+                format.colorMode = COLOR_MODE::RGB;
+                break;
+
+            default:
+                format.colorMode = COLOR_MODE::RGBA;
+                break;
+            }
+
+            if ((options.bgr) && (format.colorMode == COLOR_MODE::RGB))
+                format.colorMode = COLOR_MODE::BGR;
+            else if ((options.bgr) && (format.colorMode == COLOR_MODE::RGBA))
+                format.colorMode = COLOR_MODE::BGRA;
+
+            return;
+        }
+
+        // Whether the bit masks of format are exactly these
+        static bool HasMasks(const FileFormat& format, const byte4& r, const byte4& g, const byte4& b, const byte4& a) noexcept
+        {
+            return (format.masks[0] == r) && (format.masks[1] == g) && (format.masks[2] == b) && (format.masks[3] == a);
+        }
+
+        // Whether a 32 bit image is plain B-G-R-A
+        static bool HasStandardMasks(const FileFormat& format) noexcept
+        {
+            return HasMasks(format, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+        }
+
+        // Will scale a channel value of numBits bits to 8 bits. Narrower ones get their top bits repeated into the low bits, so the maximum becomes 255. Wider ones lose their low bits
+        static byte ExpandChannel(byte4 value, const std::size_t& numBits) noexcept
+        {
+            if (numBits >= 8)
+                return (byte)(value >> (numBits - 8));
+
+            value <<= 8 - numBits;
+            for (std::size_t have = numBits; have < 8; have *= 2)
+                value |= value >> have;
+
+            return (byte)value;
+        }
+
+        // Will turn one row of 16 or 32 bit pixels with any bit masks into one row of the pixel buffer. The slow, but general way
+        static void DecodeBitfields(const byte* src, byte* dst, const std::size_t& width, const FileFormat& format) noexcept
+        {
+            const std::size_t bytesPerPixel = format.header.bitDepth / 8;
+            const std::size_t numChannels = GetNumChannelsPXBF(format.colorMode);
+            for (std::size_t x = 0; x < width; x++, src += bytesPerPixel, dst += numChannels)
+            {
+                byte4 px = 0;
+                for (std::size_t i = 0; i < bytesPerPixel; i++)
+                    px |= (byte4)src[i] << (i * 8);
+
+                for (std::size_t c = 0; c < numChannels; c++)
+                    dst[c] = format.maskBits[c] ? ExpandChannel((px & format.masks[c]) >> format.maskShifts[c], format.maskBits[c]) : 0;
+            }
+
+            return;
+        }
+
+        // Will fill threshold with what Kernels::Rgb24ToRgb16 adds to the channels of the 4 pixels of row y that start at every multiple of 4.
+        // That's 127 everywhere (rounding to the nearest level), or a 4x4 bayer matrix spread over 0..255 for ordered dithering
+        static void GetRgb16Thresholds(const std::size_t& y, const bool& dither, byte* threshold) noexcept
+        {
+            static const byte bayer[4][4] = {
+                {  0,  8,  2, 10 },
+                { 12,  4, 14,  6 },
+                {  3, 11,  1,  9 },
+                { 15,  7, 13,  5 }
+            };
+
+            for (std::size_t x = 0; x < 4; x++)
+            {
+                const byte d = dither ? (byte)(bayer[y % 4][x] * 16 + 8) : 127;
+                threshold[x * 4 + 0] = d;
+                threshold[x * 4 + 1] = d;
+                threshold[x * 4 + 2] = d;
+                threshold[x * 4 + 3] = 0;
+            }
+
+            return;
+        }
+
+        // Will turn row y of the pixel buffer into one row of bmp pixel data (V, B-G-R, B-G-R-A or 16 bit), without padding
+        static void EncodeScanline(const byte* src, byte* dst, const std::size_t& width, const std::size_t& y, const COLOR_MODE& colorMode, const WriteOptions& options) noexcept
+        {
+            if (IsHighColor(colorMode, options))
+            {
+                // pixelbfr ==> R-G-B(-A) ==> R5-G6-B5 or X1-R5-G5-B5 ==> bmp format
+                const Kernels::Rgb16Layout& layout = options.highColor == WriteOptions::HIGH_COLOR::RGB565 ? Kernels::rgb565 : Kernels::rgb555;
+                const std::size_t numChannels = GetNumChannelsPXBF(colorMode);
+                byte threshold[16];
+                GetRgb16Thresholds(y, options.dither, threshold);
+
+                // pixelbfr ==> B-G-R(-A) ==> R-G-B(-A) first, a chunk at a time. Chunks are a multiple of 4 pixels, so the dither pattern stays in step
+                const std::size_t chunkSize = 256;
+                byte rgb[chunkSize * 4];
+                for (std::size_t x = 0; x < width; x += chunkSize)
+                {
+                    const std::size_t n = chunkSize < width - x ? chunkSize : width - x;
+                    const byte* chunk = src + x * numChannels;
+                    if (IsBgrOrder(colorMode))
+                    {
+                        if (numChannels == 3)
+                            Kernels::SwapRB24(chunk, rgb, n);
+                        else
+                            Kernels::SwapRB32(chunk, rgb, n);
+                        chunk = rgb;
+                    }
+
+                    if (numChannels == 3)
+                        Kernels::Rgb24ToRgb16(chunk, dst + x * 2, n, layout, threshold);
+                    else
+                        Kernels::Rgba32ToRgb16(chunk, dst + x * 2, n, layout, threshold);
+                }
+                return;
+            }
+
+            switch (colorMode)
+            {
+            case COLOR_MODE::BW:
+                // pixelbfr ==> V ==> palette index V ==> bmp format
+                memcpy(dst, src, width);
+                break;
+
+            case COLOR_MODE::RGB:
+                // pixelbfr ==> R-G-B ==> B-G-R ==> bmp format
+                Kernels::SwapRB24(src, dst, width);
+                break;
+
+            case COLOR_MODE::RGBA:
+                // pixelbfr ==> R-G-B-A ==> B-G-R-A ==> bmp format
+                Kernels::SwapRB32(src, dst, width);
+                break;
+
+            case COLOR_MODE::BGR:
+                // pixelbfr ==> B-G-R ==> bmp format
+                memcpy(dst, src, width * 3);
+                break;
+
+            case COLOR_MODE::BGRA:
+                // pixelbfr ==> B-G-R-A ==> bmp format
+                memcpy(dst, src, width * 4);
+                break;
+            }
+
+            return;
+        }
+
+        // Will turn one row of palette indices (one byte each) into one row of the pixel buffer
+        static void ExpandPaletteIndices(const byte* src, byte* dst, const std::size_t& width, const FileFormat& format) noexcept
+        {
+            if (format.isIdentityPalette)
+            {
+                // palette index V ==> V ==> pixelbfr
+                memcpy(dst, src, width);
+            }
+            else if (format.colorMode == COLOR_MODE::BW)
+            {
+                // palette index ==> V-V-V ==> V ==> pixelbfr
+                for (std::size_t x = 0; x < width; x++)
+                    dst[x] = format.palette[src[x] * 3];
+            }
+            else
+            {
+                // palette index ==> R-G-B ==> pixelbfr
+                Kernels::PaletteToRgb24(src, dst, width, format.palette);
+            }
+
+            return;
+        }
+
+        // Will turn one row of bmp pixel data (without padding) into one row of the pixel buffer
+        static void DecodeScanline(const byte* src, byte* dst, const std::size_t& width, const FileFormat& format) noexcept
+        {
+            switch (format.header.bitDepth)
+            {
+            case 4:
+            {
+                // bmp format ==> two palette indices per byte, high nibble first ==> pixelbfr
+                const std::size_t numChannels = GetNumChannelsPXBF(format.colorMode);
+                for (std::size_t x = 0; x < width; x++)
+                {
+                    const byte* entry = format.palette + ((src[x / 2] >> (x % 2 ? 0 : 4)) & 0x0F) * 3;
+                    memcpy(dst + x * numChannels, entry, numChannels);
+                }
+                break;
+            }
+
+            case 8:
+                ExpandPaletteIndices(src, dst, width, format);
+                break;
+
+            case 16:
+                if (HasMasks(format, 0xF800, 0x07E0, 0x001F, 0))
+                {
+                    // bmp format ==> R5-G6-B5 ==> R-G-B ==> pixelbfr
+                    Kernels::Rgb16ToRgb24(src, dst, width, Kernels::rgb565);
+                }
+                else if (HasMasks(format, 0x7C00, 0x03E0, 0x001F, 0))
+                {
+                    // bmp format ==> X1-R5-G5-B5 ==> R-G-B ==> pixelbfr
+                    Kernels::Rgb16ToRgb24(src, dst, width, Kernels::rgb555);
+                }
+                else
+                    DecodeBitfields(src, dst, width, format);
+
+                // R-G-B(-A) ==> B-G-R(-A), while the row is still in cache
+                if (IsBgrOrder(format.colorMode))
+                    SwapRB(dst, width, format.colorMode);
+                break;
+
+            case 24:
+                if (format.colorMode == COLOR_MODE::BGR)
+                {
+                    // bmp format ==> B-G-R ==> pixelbfr
+                    memcpy(dst, src, width * 3);
+                }
+                else
+                {
+                    // bmp format ==> B-G-R ==> R-G-B ==> pixelbfr
+                    Kernels::SwapRB24(src, dst, width);
+                }
+                break;
+
+            case 32:
+                if ((HasStandardMasks(format)) && (format.colorMode == COLOR_MODE::BGRA))
+                {
+                    // bmp format ==> B-G-R-A ==> pixelbfr
+                    memcpy(dst, src, width * 4);
+                }
+                else if (HasStandardMasks(format))
+                {
+                    // bmp format ==> B-G-R-A ==> R-G-B-A ==> pixelbfr
+                    Kernels::SwapRB32(src, dst, width);
+                }
+                else
+                {
+                    DecodeBitfields(src, dst, width, format);
+
+                    // R-G-B(-A) ==> B-G-R(-A), while the row is still in cache
+                    if (IsBgrOrder(format.colorMode))
+                        SwapRB(dst, width, format.colorMode);
+                }
+                break;
+
+            default:
+                break;
+            }
+
+            return;
+        }
+
+        // Will run length encode (BI_RLE8) length literal pixels to dst, and return how many bytes that took. dst == nullptr only counts
+        static std::size_t EncodeRle8Literal(const byte* src, std::size_t length, byte* dst) noexcept
+        {
+            std::size_t size = 0;
+            while (length)
+            {
+                const std::size_t n = length < 255 ? length : 255;
+                if (n < 3)
+                {
+                    // Absolute mode needs at least 3 pixels, so these become runs of 1
+                    for (std::size_t i = 0; i < n; i++, size += 2)
+                        if (dst)
+                        {
+                            dst[size] = 1;
+                            dst[size + 1] = src[i];
+                        }
+                }
+                else
+                {
+                    // Absolute mode: 0, n, then n pixels, padded to 16 bit
+                    if (dst)
+                    {
+                        dst[size] = 0;
+                        dst[size + 1] = (byte)n;
+                        memcpy(dst + size + 2, src, n);
+                        if (n % 2)
+                            dst[size + 2 + n] = 0;
+                    }
+                    size += 2 + n + n % 2;
+                }
+
+                src += n;
+                length -= n;
+            }
+
+            return size;
+        }
+
+        // Will run length encode (BI_RLE8) one row of 8 bit pixels to dst, without end of line, and return how many bytes that took.
+        // dst == nullptr only counts. Never takes more than 2 bytes per pixel
+        static std::size_t EncodeRle8Row(const byte* row, const std::size_t& width, byte* dst) noexcept
+        {
+            const unsigned long long ones = 0x0101010101010101ull;
+            const unsigned long long highs = 0x8080808080808080ull;
+
+            std::size_t size = 0;
+            std::size_t literalBegin = 0;
+            std::size_t x = 0;
+            while (x < width)
+            {
+                // Noise has no runs worth encoding. Skip 8 pixels at a time, while none of them starts a run of 3
+                while (x + 10 <= width)
+                {
+                    unsigned long long w0, w1, w2;
+                    memcpy(&w0, row + x, 8);
+                    memcpy(&w1, row + x + 1, 8);
+                    memcpy(&w2, row + x + 2, 8);
+                    const unsigned long long diff = (w0 ^ w1) | (w0 ^ w2);
+                    if ((diff - ones) & ~diff & highs) // is any byte of diff 0?
+                        break;
+                    x += 8;
+                }
+
+                // How long is the run starting at x? Long runs get compared 8 pixels at a time
+                const byte value = row[x];
+                const std::size_t maxRunLength = width - x < 255 ? width - x : 255;
+                const unsigned long long pattern = value * ones;
+                std::size_t runLength = 1;
+                while (runLength + 8 <= maxRunLength)
+                {
+                    unsigned long long w;
+                    memcpy(&w, row + x + runLength, 8);
+                    if (w != pattern)
+                        break;
+                    runLength += 8;
+                }
+                while ((runLength < maxRunLength) && (row[x + runLength] == value))
+                    runLength++;
+
+                // Runs of 1 and 2 stay part of the literal they're in
+                if (runLength < 3)
+                {
+                    x += runLength;
+                    continue;
+                }
+
+                // Encoded mode: runLength, value
+                size += EncodeRle8Literal(row + literalBegin, x - literalBegin, dst ? dst + size : nullptr);
+                if (dst)
+                {
+                    dst[size] = (byte)runLength;
+                    dst[size + 1] = value;
+                }
+                size += 2;
+
+                x += runLength;
+                literalBegin = x;
+            }
+            size += EncodeRle8Literal(row + literalBegin, width - literalBegin, dst ? dst + size : nullptr);
+
+            return size;
+        }
+
+        // Will run length encode (BI_RLE8) the whole pixel buffer of a BW image to dst, and return how many bytes that took. dst == nullptr only counts
+        std::size_t EncodeRle8(byte* dst) const noexcept
+        {
+            std::size_t size = 0;
+
+            // Dumbass unusual pixel order of bmp made me do this...
+            for (std::size_t fileRow = 0; fileRow < height; fileRow++)
+            {
+                size += EncodeRle8Row(pixelbfr + (height - 1 - fileRow) * width, width, dst ? dst + size : nullptr);
+
+                // End of line, or end of bitmap after the last one
+                if (dst)
+                {
+                    dst[size] = 0;
+                    dst[size + 1] = fileRow + 1 < height ? 0 : 1;
+                }
+                size += 2;
+            }
+
+            return size;
+        }
+
+        // Will write a BW image with a run length encoded (BI_RLE8) pixel array to bs
+        bool WriteRle(std::ostream& bs) const
+        {
+            BMPLIB_INSTRUMENT_CALL(WRITE);
+
+            // Takes a pass over the image, to know how large the pixel array gets
+            const BitmapHeader header = GetRleFileHeader();
+            byte headerData[maxHeaderSize];
+            EncodeFileHeader(header, headerData);
+            bs.write((const char*)headerData, header.offsetPixelArray);
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            // Encoded rows pile up in a buffer, which goes to the stream whenever the next one might not fit anymore
+            const std::size_t maxRowSize = 2 * width + 2;
+            const std::size_t bufferSize = maxRowSize + (1 << 16);
+            byte* buffer;
+            try
+            {
+                buffer = new byte[bufferSize];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, bufferSize);
+
+            // Dumbass unusual pixel order of bmp made me do this...
+            std::size_t used = 0;
+            for (std::size_t fileRow = 0; fileRow < height; fileRow++)
+            {
+                if (used + maxRowSize > bufferSize)
+                {
+                    BMPLIB_INSTRUMENT_LAP(SWIZZLE, used);
+                    bs.write((const char*)buffer, used);
+                    BMPLIB_INSTRUMENT_LAP(IO, used);
+                    used = 0;
+                }
+
+                used += EncodeRle8Row(pixelbfr + (height - 1 - fileRow) * width, width, buffer + used);
+
+                // End of line, or end of bitmap after the last one
+                buffer[used] = 0;
+                buffer[used + 1] = fileRow + 1 < height ? 0 : 1;
+                used += 2;
+            }
+            BMPLIB_INSTRUMENT_LAP(SWIZZLE, used);
+            bs.write((const char*)buffer, used);
+
+            delete[] buffer;
+
+            bs.flush();
+            BMPLIB_INSTRUMENT_LAP(IO, used);
+            return bs.good();
+        }
+
+        // Will decode a run length encoded (BI_RLE8 or BI_RLE4) pixel array into the pixel buffer.
+        // Pixels the file skips over become palette index 0. Returns false if the data ends before the image does, the caller has to throw the pixel buffer away then
+        bool DecodeRle(const byte* src, const std::size_t& srcSize, const FileFormat& format)
+        {
+            const bool isRle4 = format.header.compression == 2;
+
+            // One row of palette indices gets put together at a time, and then expanded into the pixel buffer
+            byte* indices;
+            try
+            {
+                indices = new byte[width];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ReleasePixelBuffer();
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            memset(indices, 0, width);
+
+            // Dumbass unusual pixel order of bmp made me do this...
+            std::size_t fileRow = 0;
+            std::size_t x = 0;
+            const auto nextRow = [&]()
+            {
+                ExpandPaletteIndices(indices, pixelbfr + (height - 1 - fileRow) * width * numChannelsPXBF, width, format);
+                memset(indices, 0, width);
+                fileRow++;
+                return;
+            };
+
+            bool success = true;
+            std::size_t pos = 0;
+            while ((fileRow < height) && (success))
+            {
+                if (pos + 2 > srcSize)
+                {
+                    // Some files just end, without an end of bitmap. That's fine, as long as the last row got there
+                    success = fileRow + 1 >= height;
+                    break;
+                }
+
+                const byte count = src[pos];
+                const byte value = src[pos + 1];
+                pos += 2;
+
+                if (count)
+                {
+                    // Encoded mode: count pixels of value. With RLE4, value holds two pixels, which take turns
+                    const std::size_t n = x < width ? (count < width - x ? count : width - x) : 0;
+                    if (isRle4)
+                    {
+                        for (std::size_t i = 0; i < n; i++)
+                            indices[x + i] = i % 2 ? (byte)(value & 0x0F) : (byte)(value >> 4);
+                    }
+                    else
+                        memset(indices + x, value, n);
+                    x += count;
+                    continue;
+                }
+
+                switch (value)
+                {
+                case 0:
+                    // End of line
+                    nextRow();
+                    x = 0;
+                    break;
+
+                case 1:
+                    // End of bitmap. Whatever is left stays index 0
+                    while (fileRow < height)
+                        nextRow();
+                    break;
+
+                case 2:
+                {
+                    // Delta: dx pixels to the right, dy rows up
+                    if (pos + 2 > srcSize)
+                    {
+                        success = false;
+                        break;
+                    }
+
+                    const std::size_t dx = src[pos];
+                    const std::size_t dy = src[pos + 1];
+                    pos += 2;
+                    for (std::size_t i = 0; (i < dy) && (fileRow < height); i++)
+                        nextRow();
+                    x += dx;
+                    break;
+                }
+
+                default:
+                {
+                    // Absolute mode: value pixels as they are, padded to 16 bit. With RLE4 two to a byte, high nibble first
+                    const std::size_t numBytes = isRle4 ? ((std::size_t)value + 1) / 2 : value;
+                    if (pos + numBytes > srcSize)
+                    {
+                        success = false;
+                        break;
+                    }
+
+                    const std::size_t n = x < width ? (value < width - x ? value : width - x) : 0;
+                    if (isRle4)
+                    {
+                        for (std::size_t i = 0; i < n; i++)
+                            indices[x + i] = (byte)((src[pos + i / 2] >> (i % 2 ? 0 : 4)) & 0x0F);
+                    }
+                    else
+                        memcpy(indices + x, src + pos, n);
+                    x += value;
+                    pos += numBytes + numBytes % 2;
+                    break;
+                }
+                }
+            }
+
+            // Rows that never got finished (or never started), because the data ended early
+            while (fileRow < height)
+                nextRow();
+
+            delete[] indices;
+            return success;
+        }
+
+        // How many scanlines Read() and Write() handle per band. Just one, without a thread pool, unless the io is overlapped
+        std::size_t GetRowsPerBand(const std::size_t& rowSize, const bool overlapped = false) const
+        {
+            if ((!threadPool) && (!overlapped))
+                return 1;
+
+            const std::size_t bandSize = (threadPool ? threadPool->GetNumThreads() : 1) << 20; // about a megabyte per worker
+            return bandSize > rowSize ? bandSize / rowSize : 1;
+        }
+
+        // Will call func(begin, end) over all rows in [0, numRows). Spread over the thread pool, if there is one
+        template <typename Func>
+        void ForEachRow(const std::size_t& numRows, const std::size_t& rowSize, const Func& func) const
+        {
+            if ((threadPool) && (numRows > 1))
+            {
+                const std::size_t chunkSize = 1 << 17; // don't bother the workers with less than this many bytes
+                threadPool->ParallelFor(numRows, chunkSize > rowSize ? chunkSize / rowSize : 1, func);
+            }
+            else
+                func(0, numRows);
+
+            return;
+        }
+
+        // Will make this image a copy of region of source
+        void CutRegion(const BMP& source, const Region& region)
+        {
+            ReInitialize(region.width, region.height, source.colorMode, false);
+
+            const std::size_t rowSize = width * numChannelsPXBF;
+            for (std::size_t y = 0; y < height; y++)
+                memcpy(pixelbfr + y * rowSize, source.pixelbfr + source.CalculatePixelIndex(region.x, region.y + y), rowSize);
+
+            return;
+        }
+
+        // Will read the whole image shrunk by factor, averaging factor x factor blocks, one scanline at a time.
+        // getScanline(fileRow) gets called for every scanline in file order, and has to return it undecoded, or nullptr if it isn't there
+        template <typename GetScanline>
+        bool DecodeDownscaled(const FileFormat& format, const std::size_t& factor, const GetScanline& getScanline)
+        {
+            const std::size_t srcWidth = format.header.imgWidth;
+            const std::size_t srcHeight = format.header.GetHeight();
+            const bool isTopDown = format.header.IsTopDown();
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize((srcWidth + factor - 1) / factor, (srcHeight + factor - 1) / factor, format.colorMode, false);
+
+            // If all decoding would do is swap red and blue, that can just as well happen to the much smaller averages
+            const bool swapAfter = (!IsPlainScanline(format)) &&
+                ((format.header.bitDepth == 24) || ((format.header.bitDepth == 32) && (HasStandardMasks(format))));
+            const bool isRaw = (IsPlainScanline(format)) || (swapAfter);
+
+            // One decoded scanline, and the sums of the scanlines of the current row of blocks
+            const std::size_t numSums = srcWidth * numChannelsPXBF;
+            std::vector<byte> row;
+            std::vector<byte2> sums;
+            try
+            {
+                row.resize(isRaw ? 0 : numSums);
+                sums.resize(numSums);
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ReleasePixelBuffer();
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+
+            bool success = true;
+            std::size_t numRows = 0; // how many rows went into sums so far
+            for (std::size_t fileRow = 0; fileRow < srcHeight; fileRow++)
+            {
+                const byte* scanline = getScanline(fileRow);
+                if (!scanline)
+                {
+                    // Half an image is no image
+                    ReleasePixelBuffer();
+                    success = false;
+                    break;
+                }
+
+                if (!isRaw)
+                    DecodeScanline(scanline, row.data(), srcWidth, format);
+                Kernels::AccumulateRow(isRaw ? scanline : row.data(), sums.data(), numSums); // 8x8 blocks of 255 still fit into 16 bit
+                numRows++;
+
+                // A row of blocks is done once the next scanline belongs to a different one, whichever way round the file goes
+                const std::size_t y = GetImageRow(fileRow, srcHeight, isTopDown) / factor;
+                if ((fileRow + 1 == srcHeight) || (GetImageRow(fileRow + 1, srcHeight, isTopDown) / factor != y))
+                {
+                    byte* dst = pixelbfr + y * width * numChannelsPXBF;
+                    AverageBlocks(sums.data(), dst, srcWidth, numChannelsPXBF, factor, numRows);
+                    if (swapAfter)
+                        SwapRB(dst, width, colorMode);
+
+                    std::fill(sums.begin(), sums.end(), (byte2)0);
+                    numRows = 0;
+                }
+            }
+
+            return success;
+        }
+
+        // Will shrink the image in place by factor, averaging factor x factor blocks. Every row of blocks lands in front of the rows it comes from, so nothing gets overwritten too early
+        void ShrinkPixelBuffer(const std::size_t& factor)
+        {
+            if (factor == 1)
+                return;
+
+            const std::size_t newWidth = (width + factor - 1) / factor;
+            const std::size_t newHeight = (height + factor - 1) / factor;
+            std::vector<byte2> sums(width * numChannelsPXBF);
+
+            for (std::size_t y = 0; y < newHeight; y++)
+            {
+                std::fill(sums.begin(), sums.end(), (byte2)0);
+                const std::size_t numRows = height - y * factor < factor ? height - y * factor : factor;
+                for (std::size_t i = 0; i < numRows; i++)
+                    Kernels::AccumulateRow(pixelbfr + (y * factor + i) * width * numChannelsPXBF, sums.data(), sums.size());
+
+                AverageBlocks(sums.data(), pixelbfr + y * newWidth * numChannelsPXBF, width, numChannelsPXBF, factor, numRows);
+            }
+
+            width = newWidth;
+            height = newHeight;
+            sizeofPxlbfr = width * height * numChannelsPXBF;
+            return;
+        }
+
+        // Will run kernel(src, dst, numPx) over the whole pixel buffer in place, converting to the pixel size of convto.
+        // Spread over the thread pool, if there is one. That's only allowed for pixels whose output doesn't land on the input of pixels not yet converted,
+        // so it happens in waves: Shrinking conversions go front to back, and every wave only writes to memory the waves before have already read.
+        // Growing conversions do the same, back to front. Ones that keep the pixel size can all go at once.
+        // With swapRB, red and blue of the converted pixels get swapped afterwards (RGB <-> BGRA and such)
+        template <typename Kernel>
+        void ConvertPixelBuffer(const Kernel& kernel, const BMP::COLOR_MODE& convto, const bool& swapRB = false)
+        {
+            const auto convert = [&kernel, &convto, &swapRB](const byte* src, byte* dst, const std::size_t& n)
+            {
+                kernel(src, dst, n);
+                if (swapRB)
+                    SwapRB(dst, n, convto);
+            };
+
+            const std::size_t numPx = width * height;
+            if (!threadPool)
+            {
+                convert(pixelbfr, pixelbfr, numPx);
+                return;
+            }
+
+            const std::size_t srcChannels = numChannelsPXBF;
+            const std::size_t dstChannels = GetNumChannelsPXBF(convto);
+            const std::size_t chunkSize = 1 << 15; // pixels per task. Also the size of the first wave, which has to run alone
+
+            const auto runWave = [&](const std::size_t& first, const std::size_t& last)
+            {
+                threadPool->ParallelFor(last - first, chunkSize, [&](std::size_t begin, std::size_t end)
+                {
+                    convert(pixelbfr + (first + begin) * srcChannels, pixelbfr + (first + begin) * dstChannels, end - begin);
+                });
+            };
+
+            if (dstChannels == srcChannels)
+                runWave(0, numPx);
+            else if (dstChannels < srcChannels)
+            {
+                std::size_t done = numPx < chunkSize ? numPx : chunkSize;
+                convert(pixelbfr, pixelbfr, done);
+
+                while (done < numPx)
+                {
+                    // The output of [done, next) ends where the input of done starts
+                    std::size_t next = done * srcChannels / dstChannels;
+                    if (next > numPx)
+                        next = numPx;
+
+                    runWave(done, next);
+                    done = next;
+                }
+            }
+            else
+            {
+                std::size_t todo = numPx;
+                while (todo > chunkSize)
+                {
+                    // The output of [first, todo) starts where the input of todo ends
+                    const std::size_t first = (todo * srcChannels + dstChannels - 1) / dstChannels;
+                    runWave(first, todo);
+                    todo = first;
+                }
+
+                convert(pixelbfr, pixelbfr, todo);
+            }
+
+            return;
+        }
+
+        // Will write a bmp image, encoding band n+1 while band n is still on its way to the file
+        bool WriteOverlapped(const std::string& filename, const WriteOptions& options) const
+        {
+            if (!isInitialized)
+                return false;
+
+            // Run length encoded rows don't have fixed places in the file to be written to, so that's a plain Write()
+            if (IsRunLengthEncoded(colorMode, options))
+                return Write(filename, options);
+
+            BMPLIB_INSTRUMENT_CALL(WRITE);
+            OverlappedFile file;
+            if (!file.Open(filename, true))
+                return false;
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+
+            const BitmapHeader header = GetFileHeader(width, height, colorMode, options);
+            const std::size_t rowSize = width * header.bitDepth / 8;
+            const std::size_t paddedRowSize = header.GetPaddedRowSize();
+            const std::size_t paddingSize = paddedRowSize - rowSize;
+
+            byte headerData[maxHeaderSize];
+            EncodeFileHeader(header, headerData);
+            file.Submit(headerData, header.offsetPixelArray, 0);
+            BMPLIB_INSTRUMENT_LAP(HEADER, header.offsetPixelArray);
+
+            // Two bands: One gets encoded while the other one is being written
+            const std::size_t rowsPerBand = GetRowsPerBand(paddedRowSize, true);
+            const std::size_t bandSize = rowsPerBand * paddedRowSize;
+            byte* bands;
+            try
+            {
+                bands = new byte[2 * bandSize];
+            }
+            catch (std::bad_alloc& e)
+            {
+                file.Close();
+
+                // too bad!
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            for (std::size_t i = 0; i < 2 * rowsPerBand; i++)
+                memset(bands + i * paddedRowSize + rowSize, 0x69, paddingSize); // dummy-data for padding
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, 2 * bandSize);
+
+            std::size_t bandIndex = 0;
+            for (std::size_t fileRow = 0; (fileRow < height) && (!file.Failed()); fileRow += rowsPerBand)
+            {
+                const std::size_t numRows = rowsPerBand < height - fileRow ? rowsPerBand : height - fileRow;
+                byte* band = bands + (bandIndex++ % 2) * bandSize;
+                ForEachRow(numRows, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+                {
+                    for (std::size_t i = begin; i < end; i++)
+                    {
+                        const std::size_t y = GetImageRow(fileRow + i, height, header.IsTopDown());
+                        EncodeScanline(pixelbfr + y * width * numChannelsPXBF, band + i * paddedRowSize, width, y, colorMode, options);
+                    }
+                });
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, numRows * width * numChannelsPXBF);
+
+                // Only one band can be on its way at a time, so this waits for the previous one first
+                file.Submit(band, numRows * paddedRowSize, header.offsetPixelArray + fileRow * paddedRowSize);
+                BMPLIB_INSTRUMENT_LAP(IO, numRows * paddedRowSize);
+            }
+
+            const bool success = file.Close();
+            BMPLIB_INSTRUMENT_LAP(IO, 0);
+            delete[] bands;
+
+            return success;
+        }
+
+        // Will read a bmp image, decoding band n while band n+1 is still on its way from the file
+        bool ReadOverlapped(const std::string& filename, const ReadOptions& options)
+        {
+            BMPLIB_INSTRUMENT_CALL(READ);
+            OverlappedFile file;
+            if (!file.Open(filename, false))
+                return false;
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+
+            // Headers and palette come in one go. Might as well ask for as much as they could possibly take
+            byte headerData[maxHeaderSize];
+            file.Submit(headerData, maxHeaderSize, 0);
+            const std::size_t headerSize = file.Wait();
+
+            BitmapHeader header;
+            if ((headerSize < BitmapHeader::size) || (!ParseFileHeader(headerData, header)) || (GetHeaderEnd(header) > headerSize))
+                return false;
+
+            // Run length encoded rows have no fixed place in the file, so there's nothing to read ahead. That's a plain Read().
+            // So is shrinking, which only needs a scanline at a time anyway
+            if ((IsRunLengthEncoded(header)) || (options.downscale != 1))
+            {
+                file.Close();
+                return Read(filename, options);
+            }
+
+            FileFormat format;
+            GetFileFormat(header, headerData, format, options);
+            BMPLIB_INSTRUMENT_LAP(HEADER, headerSize);
+
+            // Initialize image. Every pixel gets overwritten, so there's no need to make it black first
+            ReInitialize(header.imgWidth, header.GetHeight(), format.colorMode, false);
+
+            const std::size_t rowSize = format.rowSize;
+            const std::size_t paddedRowSize = format.paddedRowSize;
+            const std::size_t paddingSize = paddedRowSize - rowSize;
+
+            // Two bands: One gets decoded while the next one is being read
+            const std::size_t rowsPerBand = GetRowsPerBand(paddedRowSize, true);
+            const std::size_t bandSize = rowsPerBand * paddedRowSize;
+            byte* bands;
+            try
+            {
+                bands = new byte[2 * bandSize];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                ReleasePixelBuffer();
+                ThrowException(std::string("Can't allocate memory for scanline buffer!") + e.what());
+                return false; // This won't ever be reached but it satisfies the compiler, soooo...
+            }
+            BMPLIB_INSTRUMENT_LAP(ALLOCATE, 2 * bandSize);
+
+            std::size_t numRows = rowsPerBand < height ? rowsPerBand : height;
+            file.Submit(bands, numRows * paddedRowSize, header.offsetPixelArray);
+
+            bool success = true;
+            std::size_t bandIndex = 0;
+            for (std::size_t fileRow = 0; fileRow < height; fileRow += rowsPerBand)
+            {
+                byte* band = bands + (bandIndex++ % 2) * bandSize;
+                const std::size_t got = file.Wait();
+                BMPLIB_INSTRUMENT_LAP(IO, got);
+                if ((file.Failed()) || (got < numRows * paddedRowSize - paddingSize)) // Don't insist on the padding of the very last scanline
+                {
+                    success = false;
+                    break;
+                }
+
+                // Get the next band going, before decoding this one
+                const std::size_t nextRow = fileRow + rowsPerBand;
+                const std::size_t numRowsHere = numRows;
+                if (nextRow < height)
+                {
+                    numRows = rowsPerBand < height - nextRow ? rowsPerBand : height - nextRow;
+                    file.Submit(bands + (bandIndex % 2) * bandSize, numRows * paddedRowSize, header.offsetPixelArray + nextRow * paddedRowSize);
+                }
+
+                ForEachRow(numRowsHere, paddedRowSize, [&](const std::size_t& begin, const std::size_t& end)
+                {
+                    for (std::size_t i = begin; i < end; i++)
+                        DecodeScanline(band + i * paddedRowSize, pixelbfr + GetImageRow(fileRow + i, height, header.IsTopDown()) * width * numChannelsPXBF, width, format);
+                });
+                BMPLIB_INSTRUMENT_LAP(SWIZZLE, numRowsHere * width * numChannelsPXBF);
+            }
+
+            file.Close();
+            delete[] bands;
+            if (!success)
+                ReleasePixelBuffer();
+            BMPLIB_INSTRUMENT_LAP(OPEN, 0);
+            return success;
+        }
+
+        static void ThrowException(const std::string msg)
+        {
+            #ifndef BMPLIB_SILENT
+            #ifdef _IOSTREAM_
+            std::cerr << "BMPlib exception: " << msg << std::endl;
+            #endif
+            #endif
+            throw msg;
+            return;
+        }
+
+        std::size_t width;
+        std::size_t height;
+        std::size_t numChannelsFile; // Num channels of the file format
+        std::size_t numChannelsPXBF; // Num channels of the pixel buffer
+        COLOR_MODE colorMode;
+        bool isInitialized;
+        byte* pixelbfr;
+        std::size_t sizeofPxlbfr; // how many bytes the pixelbuffer is long
+        std::size_t capacityPxlbfr; // how many bytes are allocated for the pixelbuffer
+        std::shared_ptr<PixelAllocator> allocator; // where the pixelbuffer comes from. nullptr means malloc
+        std::shared_ptr<ThreadPool> threadPool; // who helps with Read(), Write() and ConvertTo(). nullptr means nobody
+    };
+
+    inline void swap(BMP& a, BMP& b) noexcept
+    {
+        a.Swap(b);
+        return;
+    }
+
+    // Non-owning view of a pixel buffer whose color mode is known at compile time, like ImageView<BMP::COLOR_MODE::RGB>.
+    // No switch over the color mode, and no bounds checks unless NDEBUG is undefined (debug builds), so loops over it can get vectorized.
+    // It stays valid for as long as the pixel buffer does. Anything that reinitializes or converts the BMP invalidates it.
+    // Use ConstImageView (Byte = const byte) to look at images you can't or don't want to change.
+    // Rows lie rowStride bytes apart, which is more than a row needs for sub views (SubView()) and AlignedImages. Pixels of a row never have gaps
+    template <BMP::COLOR_MODE mode, typename Byte = byte>
+    class ImageView
+    {
+    public:
+        static constexpr BMP::COLOR_MODE colorMode = mode;
+        static constexpr std::size_t numChannels = mode == BMP::COLOR_MODE::BW ? 1 : ((mode == BMP::COLOR_MODE::RGB) || (mode == BMP::COLOR_MODE::BGR)) ? 3 : 4;
+
+        // Where red, green and blue live within a pixel. BW images only have red
+        static constexpr std::size_t red = (mode == BMP::COLOR_MODE::BGR) || (mode == BMP::COLOR_MODE::BGRA) ? 2 : 0;
+        static constexpr std::size_t green = 1;
+        static constexpr std::size_t blue = 2 - red;
+        static constexpr std::size_t alpha = 3;
+
+        // Walks the pixels of a row. Dereferencing it gives you the pixel, just like GetPixel()
+        class PixelIterator
+        {
+        public:
+            explicit PixelIterator(Byte* px) noexcept
+                : px{px}
+            {
+                return;
+            }
+
+            Byte* operator*() const noexcept
+            {
+                return px;
+            }
+
+            PixelIterator& operator++() noexcept
+            {
+                px += numChannels;
+                return *this;
+            }
+
+            PixelIterator operator++(int) noexcept
+            {
+                PixelIterator before = *this;
+                px += numChannels;
+                return before;
+            }
+
+            bool operator==(const PixelIterator& other) const noexcept
+            {
+                return px == other.px;
+            }
+
+            bool operator!=(const PixelIterator& other) const noexcept
+            {
+                return px != other.px;
+            }
+
+        private:
+            Byte* px;
+        };
+
+        // One row of pixels
+        class Row
+        {
+        public:
+            Row(Byte* data, const std::size_t& width, const std::size_t& y) noexcept
+                : data{data}, width{width}, y{y}
+            {
+                return;
+            }
+
+            Byte* GetData() const noexcept
+            {
+                return data;
+            }
+
+            std::size_t GetWidth() const noexcept
+            {
+                return width;
+            }
+
+            // Which row of the image this is
+            std::size_t GetY() const noexcept
+            {
+                return y;
+            }
+
+            Byte* operator[](const std::size_t& x) const
+            {
+#ifndef NDEBUG
+                if (x >= width) BMP::ThrowException("Pixel coordinates out of range!");
+#endif
+
+                return data + x * numChannels;
+            }
+
+            PixelIterator begin() const noexcept
+            {
+                return PixelIterator(data);
+            }
+
+            PixelIterator end() const noexcept
+            {
+                return PixelIterator(data + width * numChannels);
+            }
+
+        private:
+            Byte* data;
+            std::size_t width;
+            std::size_t y;
+        };
+
+        // Walks the rows of an image, top to bottom. Dereferencing it gives you a Row
+        class RowIterator
+        {
+        public:
+            RowIterator(const ImageView* view, const std::size_t& y) noexcept
+                : view{view}, y{y}
+            {
+                return;
+            }
+
+            Row operator*() const noexcept
+            {
+                return Row(view->data + y * view->rowStride, view->width, y);
+            }
+
+            RowIterator& operator++() noexcept
+            {
+                y++;
+                return *this;
+            }
+
+            RowIterator operator++(int) noexcept
+            {
+                RowIterator before = *this;
+                y++;
+                return before;
+            }
+
+            bool operator==(const RowIterator& other) const noexcept
+            {
+                return y == other.y;
+            }
+
+            bool operator!=(const RowIterator& other) const noexcept
+            {
+                return y != other.y;
+            }
+
+        private:
+            const ImageView* view;
+            std::size_t y;
+        };
+
+        ImageView() noexcept
+            : data{nullptr}, width{0}, height{0}, rowStride{0}
+        {
+            return;
+        }
+
+        // rowStride is how many bytes lie between the starts of two rows. 0 means the rows follow each other without gaps, like in a BMP
+        ImageView(Byte* data, const std::size_t& width, const std::size_t& height, const std::size_t& rowStride = 0) noexcept
+            : data{data}, width{width}, height{height}, rowStride{rowStride ? rowStride : width * numChannels}
+        {
+            return;
+        }
+
+        // A view of byte can always be looked at as a view of const byte
+        template <typename OtherByte>
+        ImageView(const ImageView<mode, OtherByte>& other) noexcept
+            : data{other.GetData()}, width{other.GetWidth()}, height{other.GetHeight()}, rowStride{other.GetRowStride()}
+        {
+            return;
+        }
+
+        // Will view the pixel buffer of bmp. Throws if bmp has a different color mode
+        explicit ImageView(BMP& bmp)
+            : data{bmp.GetPixelBuffer()}, width{bmp.GetWidth()}, height{bmp.GetHeight()}, rowStride{bmp.GetWidth() * numChannels}
+        {
+            if ((bmp.IsInitialized()) && (bmp.GetColorMode() != mode)) BMP::ThrowException("Image view of the wrong color mode!");
+            return;
+        }
+
+        explicit ImageView(const BMP& bmp)
+            : data{bmp.GetPixelBuffer()}, width{bmp.GetWidth()}, height{bmp.GetHeight()}, rowStride{bmp.GetWidth() * numChannels}
+        {
+            if ((bmp.IsInitialized()) && (bmp.GetColorMode() != mode)) BMP::ThrowException("Image view of the wrong color mode!");
+            return;
+        }
+
+        Byte* GetData() const noexcept
+        {
+            return data;
+        }
+
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
+
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
+
+        // How many bytes lie between the starts of two rows
+        std::size_t GetRowStride() const noexcept
+        {
+            return rowStride;
+        }
+
+        // Whether the rows follow each other without gaps, so the whole view is one block of memory
+        bool IsContiguous() const noexcept
+        {
+            return rowStride == width * numChannels;
+        }
+
+        // Will return the first pixel of row y. The rest of the row follows without gaps
+        Byte* GetRow(const std::size_t& y) const
+        {
+#ifndef NDEBUG
+            if (y >= height) BMP::ThrowException("Row out of range!");
+#endif
+
+            return data + y * rowStride;
+        }
+
+        Byte* GetPixel(const std::size_t& x, const std::size_t& y) const
+        {
+#ifndef NDEBUG
+            if ((x >= width) || (y >= height)) BMP::ThrowException("Pixel coordinates out of range!");
+#endif
+
+            return data + y * rowStride + x * numChannels;
+        }
+
+        // Will return a view of the rectangle at x, y (from the top left) of size subWidth x subHeight. It shares our pixels, nothing gets copied.
+        // Throws if the rectangle doesn't lie completely within this view
+        ImageView SubView(const std::size_t& x, const std::size_t& y, const std::size_t& subWidth, const std::size_t& subHeight) const
+        {
+            if ((x > width) || (y > height) || (subWidth > width - x) || (subHeight > height - y)) BMP::ThrowException("Sub view out of range!");
+
+            return ImageView(data + y * rowStride + x * numChannels, subWidth, subHeight, rowStride);
+        }
+
+        // Will copy the pixels of source over ours, row by row. Throws if source has a different size
+        void CopyFrom(const ImageView<mode, const byte>& source) const
+        {
+            if ((source.GetWidth() != width) || (source.GetHeight() != height)) BMP::ThrowException("Image views of different sizes!");
+
+            // Contiguous both, that's one block
+            if ((IsContiguous()) && (source.IsContiguous()))
+            {
+                memmove(data, source.GetData(), height * rowStride);
+                return;
+            }
+
+            // Both might be sub views of the same image. If we lie behind source, the rows have to go bottom to top, so none gets overwritten before it got copied
+            if (std::less<const byte*>()(source.GetData(), data))
+            {
+                for (std::size_t y = height; y-- > 0;)
+                    memmove(data + y * rowStride, source.GetData() + y * source.GetRowStride(), width * numChannels);
+            }
+            else
+            {
+                for (std::size_t y = 0; y < height; y++)
+                    memmove(data + y * rowStride, source.GetData() + y * source.GetRowStride(), width * numChannels);
+            }
+
+            return;
+        }
+
+        // Same as BMP::SetPixel(), but the channel order gets decided by the compiler
+        void SetPixel(const std::size_t& x, const std::size_t& y, const byte& r, const byte& g = 0, const byte& b = 0, const byte& a = 0) const
+        {
+            Byte* px = GetPixel(x, y);
+            px[red] = r;
+
+            if (numChannels > 1)
+            {
+                px[green] = g;
+                px[blue] = b;
+            }
+
+            if (numChannels > 3)
+                px[alpha] = a;
+
+            return;
+        }
+
+        RowIterator begin() const noexcept
+        {
+            return RowIterator(this, 0);
+        }
+
+        RowIterator end() const noexcept
+        {
+            return RowIterator(this, height);
+        }
+
+    private:
+        Byte* data;
+        std::size_t width;
+        std::size_t height;
+        std::size_t rowStride; // bytes between the starts of two rows
+    };
+
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr BMP::COLOR_MODE ImageView<mode, Byte>::colorMode;
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr std::size_t ImageView<mode, Byte>::numChannels;
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr std::size_t ImageView<mode, Byte>::red;
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr std::size_t ImageView<mode, Byte>::green;
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr std::size_t ImageView<mode, Byte>::blue;
+    template <BMP::COLOR_MODE mode, typename Byte> constexpr std::size_t ImageView<mode, Byte>::alpha;
+
+    template <BMP::COLOR_MODE mode>
+    using ConstImageView = ImageView<mode, const byte>;
+
+    // Image whose rows all start at a multiple of alignment bytes (32 for AVX2, 64 for a cache line), for kernels that want aligned loads and stores.
+    // The gap at the end of every row is just padding. Work on it through GetView(), and copy from and to BMPs via ImageView::CopyFrom()
+    template <BMP::COLOR_MODE mode>
+    class AlignedImage
+    {
+    public:
+        static constexpr std::size_t numChannels = ImageView<mode>::numChannels;
+
+        AlignedImage() noexcept
+            : pixelbfr{nullptr}, sizeofPxlbfr{0}, width{0}, height{0}, rowStride{0}, alignment{0}
+        {
+            return;
+        }
+
+        // alignment has to be a power of two. Set zeroFill to false to skip making the image (and the padding) black
+        explicit AlignedImage(const std::size_t& width, const std::size_t& height, const std::size_t& alignment = 64, const bool zeroFill = true)
+            : AlignedImage()
+        {
+            ReInitialize(width, height, alignment, zeroFill);
+            return;
+        }
+
+        // Same as with BMPs, copying the whole pixel buffer doesn't happen implicitly
+        AlignedImage(const AlignedImage&) = delete;
+        AlignedImage& operator=(const AlignedImage&) = delete;
+
+        AlignedImage(AlignedImage&& other) noexcept
+            : AlignedImage()
+        {
+            Swap(other);
+            return;
+        }
+
+        AlignedImage& operator=(AlignedImage&& other) noexcept
+        {
+            if (this != &other)
+            {
+                AlignedImage old(std::move(*this));
+                Swap(other);
+            }
+            return *this;
+        }
+
+        void Swap(AlignedImage& other) noexcept
+        {
+            std::swap(pixelbfr, other.pixelbfr);
+            std::swap(sizeofPxlbfr, other.sizeofPxlbfr);
+            std::swap(width, other.width);
+            std::swap(height, other.height);
+            std::swap(rowStride, other.rowStride);
+            std::swap(alignment, other.alignment);
+            return;
+        }
+
+        void ReInitialize(const std::size_t& width, const std::size_t& height, const std::size_t& alignment = 64, const bool zeroFill = true)
+        {
+            if ((!width) || (!height)) BMP::ThrowException("Bad image dimensions!");
+            if ((!alignment) || (alignment & (alignment - 1))) BMP::ThrowException("Bad row alignment!");
+
+            Release();
+
+            // Round every row up to the next multiple of alignment
+            const std::size_t newRowStride = (width * numChannels + alignment - 1) / alignment * alignment;
+            pixelbfr = AlignedAllocator(alignment).Allocate(newRowStride * height);
+            if (!pixelbfr)
+            {
+                // too bad!
+                BMP::ThrowException("Can't allocate memory for pixelbuffer!");
+            }
+
+            if (zeroFill)
+                memset(pixelbfr, 0, newRowStride * height);
+
+            sizeofPxlbfr = newRowStride * height;
+            this->width = width;
+            this->height = height;
+            rowStride = newRowStride;
+            this->alignment = alignment;
+            return;
+        }
+
+        // Will free the pixel buffer
+        void Release() noexcept
+        {
+            if (pixelbfr)
+                AlignedAllocator(alignment).Deallocate(pixelbfr, sizeofPxlbfr);
+
+            pixelbfr = nullptr;
+            sizeofPxlbfr = 0;
+            width = 0;
+            height = 0;
+            rowStride = 0;
+            return;
+        }
+
+        ImageView<mode> GetView() noexcept
+        {
+            return ImageView<mode>(pixelbfr, width, height, rowStride);
+        }
+
+        ConstImageView<mode> GetView() const noexcept
+        {
+            return ConstImageView<mode>(pixelbfr, width, height, rowStride);
+        }
+
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
+
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
+
+        std::size_t GetRowStride() const noexcept
+        {
+            return rowStride;
+        }
+
+        std::size_t GetAlignment() const noexcept
+        {
+            return alignment;
+        }
+
+        ~AlignedImage()
+        {
+            Release();
+            return;
+        }
+
+    private:
+        byte* pixelbfr;
+        std::size_t sizeofPxlbfr; // how many bytes the pixelbuffer is long, padding included
+        std::size_t width;
+        std::size_t height;
+        std::size_t rowStride; // bytes between the starts of two rows. A multiple of the alignment
+        std::size_t alignment;
+    };
 
-            // write file
-            std::ofstream bs;
-            bs.open(filename, std::ofstream::binary);
-            if (!bs.good())
+    template <BMP::COLOR_MODE mode> constexpr std::size_t AlignedImage<mode>::numChannels;
+
+#ifdef __linux__
+    // Read-only view of a bmp file that gets mapped into memory instead of read.
+    // Opening only parses the header, so it costs the same for any file size. Pixels only get decoded row by row, when asked for.
+    // Rows are counted top to bottom, just like in BMP.
+    class MappedBMP
+    {
+    public:
+        MappedBMP() noexcept
+        {
+            mapping = nullptr;
+            sizeofMapping = 0;
+            pixelArray = nullptr;
+            paddedRowSize = 0;
+            width = 0;
+            height = 0;
+            colorMode = BMP::COLOR_MODE::RGB;
+            return;
+        }
+
+        MappedBMP(const MappedBMP&) = delete;
+        MappedBMP& operator=(const MappedBMP&) = delete;
+
+        // Will map a bmp image into memory. options say what DecodeRow() decodes to
+        bool Open(const std::string& filename, const ReadOptions& options = ReadOptions())
+        {
+            Close();
+
+            const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
                 return false;
 
-            bytestring bytes = data.str();
-            bs.write((const char*)bytes.c_str(), bytes.length());
-            bs.flush();
-            bs.close();
+            struct stat fileInfo;
+            if ((fstat(fd, &fileInfo) != 0) || ((std::size_t)fileInfo.st_size < BitmapHeader::size))
+            {
+                close(fd);
+                return false;
+            }
+
+            void* addr = mmap(nullptr, (std::size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd); // The mapping keeps the file alive on its own
+            if (addr == MAP_FAILED)
+                return false;
+
+            mapping = (const byte*)addr;
+            sizeofMapping = (std::size_t)fileInfo.st_size;
+
+            // Same header parsing as BMP::Read
+            BitmapHeader header;
+            // Run length encoded rows have no fixed place in the file, so those can't be mapped
+            if ((!BMP::ParseFileHeader(mapping, header)) || (BMP::IsRunLengthEncoded(header)) || (header.offsetPixelArray > sizeofMapping) || (options.downscale != 1))
+            {
+                Close();
+                return false;
+            }
+            BMP::GetFileFormat(header, mapping, format, options);
+
+            // Make sure every scanline lies within the file
+            const std::size_t rowSize = format.rowSize;
+            paddedRowSize = format.paddedRowSize;
+            if (((sizeofMapping - header.offsetPixelArray) / paddedRowSize < header.GetHeight() - 1) ||
+                ((sizeofMapping - header.offsetPixelArray) - paddedRowSize * (header.GetHeight() - 1) < rowSize))
+            {
+                Close();
+                return false;
+            }
+
+            pixelArray = mapping + header.offsetPixelArray;
+            width = header.imgWidth;
+            height = header.GetHeight();
+            colorMode = format.colorMode;
 
             return true;
         }
 
-        // Will read a bmp image
-        bool Read(std::string filename)
+        // Will unmap the file
+        void Close() noexcept
         {
-            std::ifstream bs;
+            if (mapping)
+                munmap((void*)mapping, sizeofMapping);
+
+            mapping = nullptr;
+            sizeofMapping = 0;
+            pixelArray = nullptr;
+            paddedRowSize = 0;
+            width = 0;
+            height = 0;
+            return;
+        }
+
+        bool IsOpen() const noexcept
+        {
+            return pixelArray != nullptr;
+        }
+
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
+
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
+
+        // The color mode rows get decoded to
+        BMP::COLOR_MODE GetColorMode() const noexcept
+        {
+            return colorMode;
+        }
+
+        const BitmapHeader& GetHeader() const noexcept
+        {
+            return format.header;
+        }
+
+        // How many bytes lie between two rows in the file
+        std::size_t GetRowStride() const noexcept
+        {
+            return paddedRowSize;
+        }
+
+        // Will return the raw, undecoded (palette indices, B-G-R or B-G-R-A) scanline of row y, straight out of the file
+        const byte* GetRow(const std::size_t& y) const
+        {
+            if (y >= height) BMP::ThrowException("Row out of range!");
+
+            return pixelArray + BMP::GetImageRow(y, height, format.header.IsTopDown()) * paddedRowSize;
+        }
+
+        // Will decode row y to dst, in the same layout as a BMP pixel buffer row
+        void DecodeRow(const std::size_t& y, byte* dst) const
+        {
+            BMP::DecodeScanline(GetRow(y), dst, width, format);
+            return;
+        }
+
+        ~MappedBMP()
+        {
+            Close();
+            return;
+        }
+
+    private:
+        BMP::FileFormat format;
+        const byte* mapping;
+        std::size_t sizeofMapping;
+        const byte* pixelArray;
+        std::size_t paddedRowSize; // how many bytes a scanline takes up in the file
+        std::size_t width;
+        std::size_t height;
+        BMP::COLOR_MODE colorMode;
+    };
+#endif
+
+    // Will read a bmp image a band of scanlines at a time, top to bottom, without ever holding the whole image in memory
+    class BMPStreamReader
+    {
+    public:
+        BMPStreamReader() noexcept
+        {
+            width = 0;
+            height = 0;
+            colorMode = BMP::COLOR_MODE::RGB;
+            paddedRowSize = 0;
+            nextRow = 0;
+            bandbfr = nullptr;
+            sizeofBandbfr = 0;
+            return;
+        }
+
+        BMPStreamReader(const BMPStreamReader&) = delete;
+        BMPStreamReader& operator=(const BMPStreamReader&) = delete;
+
+        // Will open a bmp image and read its header. options say what the rows get decoded to
+        bool Open(const std::string& filename, const ReadOptions& options = ReadOptions())
+        {
+            Close();
+
             bs.open(filename, std::ifstream::binary);
             if (!bs.good())
                 return false;
 
-            // Check BMP signature
-            byte2 signature;
-            FromBytes(bs, signature);
-            if (signature != 0x4D42)
+            // Headers, then the palette if there is one
+            byte headerData[BMP::maxHeaderSize];
+            BitmapHeader header;
+            if ((!bs.read((char*)headerData, BitmapHeader::size)) ||
+                (!BMP::ParseFileHeader(headerData, header)) ||
+                (BMP::IsRunLengthEncoded(header)) ||
+                (options.downscale != 1) ||
+                (!bs.read((char*)headerData + BitmapHeader::size, BMP::GetHeaderEnd(header) - BitmapHeader::size)))
+            {
+                Close();
                 return false;
+            }
+            BMP::GetFileFormat(header, headerData, format, options);
 
-            // Gather filesize
-            byte4 fileLen;
-            FromBytes(bs, fileLen);
+            width = header.imgWidth;
+            height = header.GetHeight();
+            colorMode = format.colorMode;
+            paddedRowSize = format.paddedRowSize;
+            nextRow = 0;
 
-            byte2 unused0;
-            byte2 unused1;
-            FromBytes(bs, unused0);
-            FromBytes(bs, unused1);
+            return true;
+        }
 
-            byte4 offsetPixelArray;
-            FromBytes(bs, offsetPixelArray);
+        void Close() noexcept
+        {
+            if (bs.is_open())
+                bs.close();
+            bs.clear();
 
-            byte4 dibHeadLen;
-            FromBytes(bs, dibHeadLen);
+            width = 0;
+            height = 0;
+            nextRow = 0;
+            return;
+        }
 
-            // Gather image dimensions
-            byte4 imgWidth;
-            byte4 imgHeight;
-            FromBytes(bs, imgWidth);
-            FromBytes(bs, imgHeight);
+        bool IsOpen() const noexcept
+        {
+            return bs.is_open();
+        }
 
-            byte2 numPlanes;
-            FromBytes(bs, numPlanes);
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
 
-            // Gather image bit-depth
-            byte2 bitDepth;
-            FromBytes(bs, bitDepth);
-            switch (bitDepth)
-            {
-                // BW is not supported so we can't read a bw image
-            case 24:
-                colorMode = COLOR_MODE::RGB;
-                break;
-            case 32:
-                colorMode = COLOR_MODE::RGBA;
-            }
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
 
-            byte4 compression;
-            FromBytes(bs, compression);
+        // The color mode rows get decoded to
+        BMP::COLOR_MODE GetColorMode() const noexcept
+        {
+            return colorMode;
+        }
 
-            // Gather size of pixel buffer
-            byte4 sizeofPixelBuffer;
-            FromBytes(bs, sizeofPixelBuffer);
+        // Index of the row the next read will start at
+        std::size_t GetNextRow() const noexcept
+        {
+            return nextRow;
+        }
 
-            byte4 printresX;
-            byte4 printresY;
-            FromBytes(bs, printresX);
-            FromBytes(bs, printresY);
+        // Will decode the next (up to) numRows rows to dst, in the same layout as a BMP pixel buffer.
+        // Returns how many rows it read. 0 means there are no rows left, or the file is broken.
+        std::size_t ReadRows(byte* dst, const std::size_t& numRows)
+        {
+            if ((!bs.is_open()) || (nextRow >= height))
+                return 0;
 
-            byte4 colorsInPalette;
-            byte4 importantColors;
-            FromBytes(bs, colorsInPalette);
-            FromBytes(bs, importantColors);
+            const std::size_t n = numRows < height - nextRow ? numRows : height - nextRow;
+            const std::size_t rowSize = format.rowSize;
+            const std::size_t rowSizePXBF = width * BMP::GetNumChannelsPXBF(colorMode);
+            ReserveBand(n * paddedRowSize);
 
-            // Go to the beginning of the pixel array
-            bs.seekg(offsetPixelArray);
+            // Rows nextRow to nextRow+n-1 lie in the file back to back (in reverse, unless it's top-down), so it's still just one read
+            const bool isTopDown = format.header.IsTopDown();
+            const std::size_t firstFileRow = isTopDown ? nextRow : height - nextRow - n;
+            bs.seekg(format.header.offsetPixelArray + firstFileRow * paddedRowSize);
+            bs.read((char*)bandbfr, n * paddedRowSize);
+            if ((std::size_t)bs.gcount() < (n - 1) * paddedRowSize + rowSize) // Don't insist on the padding of the very last scanline
+                return 0;
+            bs.clear();
 
-            // Initialize image
-            ReInitialize(imgWidth, imgHeight, colorMode);
+            for (std::size_t i = 0; i < n; i++)
+                BMP::DecodeScanline(bandbfr + BMP::GetImageRow(i, n, isTopDown) * paddedRowSize, dst + i * rowSizePXBF, width, format);
 
-            // Calculate scanline padding size
-            std::size_t paddingSize = (4 - ((width * numChannelsFile) % 4)) % 4;
-            paddingSize = paddingSize < 4 ? paddingSize : 0;
+            nextRow += n;
+            return n;
+        }
 
-            // Dumbass unusual pixel order of bmp made me do this...
-            for (long long y = imgHeight - 1; y >= 0; y--)
-            {
-                std::size_t byteCounter = 0;
-                for (std::size_t x = 0; x < imgWidth; x++)
-                {
-                    std::size_t idx = CalculatePixelIndex(x, (std::size_t)y); // No precision lost here. I just need a type that can get as large as std::size_t but is also signed (because for y >= 0)
+        // Will decode the next (up to) numRows rows into band, which will be resized to fit them.
+        // Returns false if there are no rows left, or the file is broken.
+        bool ReadBand(BMP& band, const std::size_t& numRows)
+        {
+            if ((!bs.is_open()) || (nextRow >= height) || (!numRows))
+                return false;
 
-                    switch (colorMode)
-                    {
-                    case COLOR_MODE::RGB:
-                        // bmp format ==> B-G-R ==> R-G-B ==> pixelbfr
-                        bs.read((char*)(pixelbfr + idx + 2), 1); // Read B byte
-                        bs.read((char*)(pixelbfr + idx + 1), 1); // Read G byte
-                        bs.read((char*)(pixelbfr + idx + 0), 1); // Read R byte
-                        byteCounter += 3;
-                        break;
+            const std::size_t n = numRows < height - nextRow ? numRows : height - nextRow;
+            band.ReInitialize(width, n, colorMode, false);
+            return ReadRows(band.GetPixelBuffer(), n) == n;
+        }
 
-                    case COLOR_MODE::RGBA:
-                        // bmp format ==> B-G-R-A ==> R-G-B-A ==> pixelbfr
-                        bs.read((char*)(pixelbfr + idx + 2), 1); // Read B byte
-                        bs.read((char*)(pixelbfr + idx + 1), 1); // Read G byte
-                        bs.read((char*)(pixelbfr + idx + 0), 1); // Read R byte
-                        bs.read((char*)(pixelbfr + idx + 3), 1); // Read A byte
-                        byteCounter += 4;
-                        break;
+        ~BMPStreamReader()
+        {
+            Close();
+            delete[] bandbfr;
+            return;
+        }
 
-                    default:
-                        break;
-                    }
-                }
+    private:
+        void ReserveBand(const std::size_t& size)
+        {
+            if (size <= sizeofBandbfr)
+                return;
 
-                if ((colorMode == COLOR_MODE::BW) || (colorMode == COLOR_MODE::RGB)) // RGBA will always be a multiple of 4 bytes
-                   if (byteCounter % 4) // If this scan line was not a multiple of 4 bytes long, account for padding
-                        bs.ignore(paddingSize);
+            delete[] bandbfr;
+            bandbfr = nullptr;
+            sizeofBandbfr = 0;
+
+            try
+            {
+                bandbfr = new byte[size];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                BMP::ThrowException(std::string("Can't allocate memory for band buffer!") + e.what());
             }
 
+            sizeofBandbfr = size;
+            return;
+        }
+
+        std::ifstream bs;
+        BMP::FileFormat format;
+        std::size_t width;
+        std::size_t height;
+        BMP::COLOR_MODE colorMode;
+        std::size_t paddedRowSize; // how many bytes a scanline takes up in the file
+        std::size_t nextRow;
+        byte* bandbfr;             // raw file data of the current band
+        std::size_t sizeofBandbfr;
+    };
+
+    // Will write a bmp image a band of scanlines at a time, top to bottom, without ever holding the whole image in memory
+    class BMPStreamWriter
+    {
+    public:
+        BMPStreamWriter() noexcept
+        {
+            width = 0;
+            height = 0;
+            colorMode = BMP::COLOR_MODE::RGB;
+            paddedRowSize = 0;
+            nextRow = 0;
+            bandbfr = nullptr;
+            sizeofBandbfr = 0;
+            return;
+        }
+
+        BMPStreamWriter(const BMPStreamWriter&) = delete;
+        BMPStreamWriter& operator=(const BMPStreamWriter&) = delete;
+
+        // Will create a bmp image of the given size and write its header. The rows have to follow via WriteRows or WriteBand.
+        // Run length encoding isn't possible here, so options.rle gets ignored
+        bool Open(const std::string& filename, const std::size_t& width, const std::size_t& height, const BMP::COLOR_MODE& colorMode = BMP::COLOR_MODE::RGB, const WriteOptions& options = WriteOptions())
+        {
+            Close();
+
+            if ((!width) || (!height)) BMP::ThrowException("Bad image dimensions!");
+
+            bs.open(filename, std::ofstream::binary);
+            if (!bs.good())
+                return false;
+
+            header = BMP::GetFileHeader(width, height, colorMode, options);
+            byte headerData[BMP::maxHeaderSize];
+            BMP::EncodeFileHeader(header, headerData);
+            bs.write((const char*)headerData, header.offsetPixelArray);
+
+            this->width = width;
+            this->height = height;
+            this->colorMode = colorMode;
+            this->options = options;
+            paddedRowSize = header.GetPaddedRowSize();
+            nextRow = 0;
+
+            return bs.good();
+        }
+
+        // Will flush and close the file. Returns false if something went wrong, or not all rows have been written
+        bool Close()
+        {
+            if (!bs.is_open())
+                return false;
+
+            bs.flush();
+            const bool success = (bs.good()) && (nextRow == height);
             bs.close();
-            return true;
+            bs.clear();
+
+            width = 0;
+            height = 0;
+            nextRow = 0;
+            return success;
         }
 
-        ~BMP()
+        bool IsOpen() const noexcept
         {
-            if (isInitialized)
+            return bs.is_open();
+        }
+
+        std::size_t GetWidth() const noexcept
+        {
+            return width;
+        }
+
+        std::size_t GetHeight() const noexcept
+        {
+            return height;
+        }
+
+        BMP::COLOR_MODE GetColorMode() const noexcept
+        {
+            return colorMode;
+        }
+
+        // Index of the row the next write will start at
+        std::size_t GetNextRow() const noexcept
+        {
+            return nextRow;
+        }
+
+        // Will encode and write the next numRows rows from src, which has the same layout as a BMP pixel buffer.
+        // Unless rowStride says how many bytes lie between the starts of two rows of src. 0 means the rows follow each other without gaps
+        bool WriteRows(const byte* src, const std::size_t& numRows, const std::size_t& rowStride = 0)
+        {
+            if ((!bs.is_open()) || (numRows > height - nextRow))
+                return false;
+
+            if (!numRows)
+                return true;
+
+            const std::size_t rowSize = width * header.bitDepth / 8;
+            const std::size_t rowStridePXBF = rowStride ? rowStride : width * BMP::GetNumChannelsPXBF(colorMode);
+            ReserveBand(numRows * paddedRowSize);
+
+            // The rows end up in the file back to back (in reverse, unless it's top-down), so it's still just one write
+            const bool isTopDown = header.IsTopDown();
+            for (std::size_t i = 0; i < numRows; i++)
             {
-                delete[] pixelbfr;
-                pixelbfr = nullptr;
+                byte* scanline = bandbfr + BMP::GetImageRow(i, numRows, isTopDown) * paddedRowSize;
+                BMP::EncodeScanline(src + i * rowStridePXBF, scanline, width, nextRow + i, colorMode, options);
+                memset(scanline + rowSize, 0x69, paddedRowSize - rowSize); // dummy-data for padding
             }
+
+            const std::size_t firstFileRow = isTopDown ? nextRow : height - nextRow - numRows;
+            bs.seekp(header.offsetPixelArray + firstFileRow * paddedRowSize);
+            bs.write((const char*)bandbfr, numRows * paddedRowSize);
+            if (!bs.good())
+                return false;
+
+            nextRow += numRows;
+            return true;
+        }
+
+        // Will encode and write all rows of band as the next rows. band has to match the width and color mode of the image
+        bool WriteBand(const BMP& band)
+        {
+            if ((!band.IsInitialized()) || (band.GetWidth() != width) || (band.GetColorMode() != colorMode))
+                return false;
+
+            return WriteRows(band.GetPixelBuffer(), band.GetHeight());
+        }
+
+        // Same, for a view. Sub views of a bigger image and AlignedImages get written straight from where their rows are, without copying them first
+        template <BMP::COLOR_MODE mode, typename Byte>
+        bool WriteBand(const ImageView<mode, Byte>& band)
+        {
+            if ((band.GetWidth() != width) || (mode != colorMode))
+                return false;
+
+            return WriteRows(band.GetData(), band.GetHeight(), band.GetRowStride());
+        }
+
+        ~BMPStreamWriter()
+        {
+            if (bs.is_open())
+                Close();
+            delete[] bandbfr;
             return;
         }
 
     private:
-        void ThrowException(const std::string msg) const
+        void ReserveBand(const std::size_t& size)
         {
-            #ifndef BMPLIB_SILENT
-            #ifdef _IOSTREAM_
-            std::cerr << "BMPlib exception: " << msg << std::endl;
-            #endif
-            #endif
-            throw msg;
+            if (size <= sizeofBandbfr)
+                return;
+
+            delete[] bandbfr;
+            bandbfr = nullptr;
+            sizeofBandbfr = 0;
+
+            try
+            {
+                bandbfr = new byte[size];
+            }
+            catch (std::bad_alloc& e)
+            {
+                // too bad!
+                BMP::ThrowException(std::string("Can't allocate memory for band buffer!") + e.what());
+            }
+
+            sizeofBandbfr = size;
             return;
         }
 
+        std::ofstream bs;
+        BitmapHeader header;
         std::size_t width;
         std::size_t height;
-        std::size_t numChannelsFile; // Num channels of the file format
-        std::size_t numChannelsPXBF; // Num channels of the pixel buffer
-        COLOR_MODE colorMode;
-        bool isInitialized;
-        byte* pixelbfr;
-        std::size_t sizeofPxlbfr; // how many bytes the pixelbuffer is long
+        BMP::COLOR_MODE colorMode;
+        WriteOptions options;
+        std::size_t paddedRowSize; // how many bytes a scanline takes up in the file
+        std::size_t nextRow;
+        byte* bandbfr;             // encoded file data of the current band
+        std::size_t sizeofBandbfr;
     };
 }
@@ -0,0 +1,327 @@
+// Benchmark suite for the hot paths of BMPlib.
+// Prints one CSV line per measurement, so runs of different commits can be diffed or plotted.
+//
+// Build:  g++ -std=c++17 -O2 benchmark.cpp -o benchmark -lpthread
+// Usage:  benchmark [--max-pixels N] [--min-time SECONDS] [--file PATH]
+//
+// Columns:
+//   benchmark    what got measured
+//   size         name of the image size
+//   width,height,mode   the image (mode is the source mode for conversions)
+//   iterations   how often it ran
+//   ns_per_px    best iteration, in nanoseconds per pixel
+//   gb_per_s     bytes moved (see below) per second, for the best iteration
+//   allocs       heap allocations per iteration (operator new plus pixel buffer allocations)
+//   alloc_bytes  bytes allocated per iteration
+//
+// Bytes moved are the file size for Read/Write, source plus destination buffer for ConvertTo, and the pixel buffer otherwise.
+
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include "BMPlib.h"
+
+using namespace BMPlib;
+
+// Every heap allocation of the process gets counted
+static std::atomic<std::size_t> numAllocs{0};
+static std::atomic<std::size_t> numAllocBytes{0};
+
+// Both go straight to malloc. Having new[] call new would pair it with free() through a different operator, as far as the compiler can tell
+static void* CountedMalloc(std::size_t size)
+{
+    numAllocs++;
+    numAllocBytes += size;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size)
+{
+    return CountedMalloc(size);
+}
+
+void* operator new[](std::size_t size)
+{
+    return CountedMalloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+    return;
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+    return;
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    free(ptr);
+    return;
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    free(ptr);
+    return;
+}
+
+// Pixel buffers don't go through operator new, so they get counted here
+class CountingAllocator : public MallocAllocator
+{
+public:
+    byte* Allocate(const std::size_t& size) override
+    {
+        numAllocs++;
+        numAllocBytes += size;
+        return MallocAllocator::Allocate(size);
+    }
+
+    byte* Reallocate(byte* ptr, const std::size_t& oldSize, const std::size_t& newSize) override
+    {
+        numAllocs++;
+        numAllocBytes += newSize;
+        return MallocAllocator::Reallocate(ptr, oldSize, newSize);
+    }
+};
+
+struct Size
+{
+    std::size_t width;
+    std::size_t height;
+    const char* name;
+};
+
+struct Settings
+{
+    std::size_t maxPixels = 15360 * 8640;
+    double minTime = 0.25;
+    std::string file = "benchmark.tmp.bmp";
+};
+
+static std::shared_ptr<CountingAllocator> countingAllocator = std::make_shared<CountingAllocator>();
+static volatile std::size_t sink; // keeps results alive, so the compiler can't skip the work
+
+const char* ModeName(const BMP::COLOR_MODE& mode)
+{
+    switch (mode)
+    {
+    case BMP::COLOR_MODE::BW:
+        return "BW";
+    case BMP::COLOR_MODE::RGB:
+        return "RGB";
+    case BMP::COLOR_MODE::RGBA:
+        return "RGBA";
+    case BMP::COLOR_MODE::BGR:
+        return "BGR";
+    default:
+        return "BGRA";
+    }
+}
+
+std::size_t NumChannels(const BMP::COLOR_MODE& mode)
+{
+    switch (mode)
+    {
+    case BMP::COLOR_MODE::BW:
+        return 1;
+    case BMP::COLOR_MODE::RGB:
+    case BMP::COLOR_MODE::BGR:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// Will run setup() and then run() over and over, until minTime has passed. Only run() gets timed
+template <typename Setup, typename Run>
+void Measure(const Settings& settings, const std::string& name, const Size& size, const BMP::COLOR_MODE& mode, const std::size_t& bytesMoved, Setup setup, Run run)
+{
+    double best = 1e300;
+    double total = 0;
+    std::size_t iterations = 0;
+    std::size_t allocs = 0;
+    std::size_t allocBytes = 0;
+
+    while ((iterations < 1) || ((total < settings.minTime) && (iterations < 1000000)))
+    {
+        setup();
+
+        const std::size_t allocsBefore = numAllocs;
+        const std::size_t allocBytesBefore = numAllocBytes;
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        allocs += numAllocs - allocsBefore;
+        allocBytes += numAllocBytes - allocBytesBefore;
+
+        total += seconds;
+        best = seconds < best ? seconds : best;
+        iterations++;
+    }
+
+    const double numPx = (double)size.width * size.height;
+    printf("%s,%s,%zu,%zu,%s,%zu,%.4f,%.4f,%.2f,%.0f\n",
+        name.c_str(), size.name, size.width, size.height, ModeName(mode), iterations,
+        best * 1e9 / numPx, bytesMoved / best / 1e9,
+        (double)allocs / iterations, (double)allocBytes / iterations);
+    fflush(stdout);
+    return;
+}
+
+void RunSize(const Settings& settings, const Size& size)
+{
+    const BMP::COLOR_MODE modes[] = { BMP::COLOR_MODE::BW, BMP::COLOR_MODE::RGB, BMP::COLOR_MODE::RGBA, BMP::COLOR_MODE::BGR, BMP::COLOR_MODE::BGRA };
+    const std::size_t numPx = size.width * size.height;
+    std::mt19937 rng(1234);
+
+    for (const BMP::COLOR_MODE& mode : modes)
+    {
+        const std::size_t numChannels = NumChannels(mode);
+        const std::size_t bufferSize = numPx * numChannels;
+
+        BMP source(size.width, size.height, mode, countingAllocator, false);
+        for (std::size_t i = 0; i < bufferSize; i++)
+            source.GetPixelBuffer()[i] = (byte)rng();
+
+        // Write / Read
+        source.Write(settings.file);
+        std::size_t fileSize = 0;
+        if (FILE* f = fopen(settings.file.c_str(), "rb"))
+        {
+            fseek(f, 0, SEEK_END);
+            fileSize = (std::size_t)ftell(f);
+            fclose(f);
+        }
+
+        Measure(settings, "Write", size, mode, fileSize, []() {}, [&]() { sink = source.Write(settings.file); });
+
+        // BGR and BGRA get read back as such
+        ReadOptions readOptions;
+        readOptions.bgr = (mode == BMP::COLOR_MODE::BGR) || (mode == BMP::COLOR_MODE::BGRA);
+
+        BMP reused(countingAllocator);
+        Measure(settings, "Read", size, mode, fileSize, []() {}, [&]() { sink = reused.Read(settings.file, readOptions); });
+        Measure(settings, "ReadFresh", size, mode, fileSize, []() {}, [&]() { BMP fresh(countingAllocator); sink = fresh.Read(settings.file, readOptions); });
+
+        // ConvertTo, for every pair
+        BMP work(countingAllocator);
+        for (const BMP::COLOR_MODE& target : modes)
+        {
+            if (target == mode)
+                continue;
+
+            Measure(settings, std::string("ConvertTo") + ModeName(target), size, mode, numPx * (numChannels + NumChannels(target)),
+                [&]() { work.CopyFrom(source); },
+                [&]() { work.ConvertTo(target); });
+        }
+
+        // Pixel access loops
+        Measure(settings, "SetPixel", size, mode, bufferSize, []() {}, [&]()
+        {
+            for (std::size_t y = 0; y < size.height; y++)
+                for (std::size_t x = 0; x < size.width; x++)
+                    source.SetPixel(x, y, (byte)x, (byte)y, (byte)(x + y), 255);
+        });
+
+        Measure(settings, "GetPixel", size, mode, bufferSize, []() {}, [&]()
+        {
+            std::size_t sum = 0;
+            for (std::size_t y = 0; y < size.height; y++)
+                for (std::size_t x = 0; x < size.width; x++)
+                    sum += source.GetPixel(x, y)[0];
+            sink = sum;
+        });
+
+        Measure(settings, "CalculatePixelIndex", size, mode, bufferSize, []() {}, [&]()
+        {
+            std::size_t sum = 0;
+            for (std::size_t y = 0; y < size.height; y++)
+                for (std::size_t x = 0; x < size.width; x++)
+                    sum += source.CalculatePixelIndex(x, y);
+            sink = sum;
+        });
+    }
+
+    remove(settings.file.c_str());
+    return;
+}
+
+void PrintUsage()
+{
+    std::cerr << "Usage: benchmark [--max-pixels N] [--min-time SECONDS] [--file PATH]" << std::endl;
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    Settings settings;
+
+    // Every option takes a value
+    if (argc % 2 == 0)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        try
+        {
+            if (arg == "--max-pixels")
+                settings.maxPixels = std::stoull(argv[i + 1]);
+            else if (arg == "--min-time")
+                settings.minTime = std::stod(argv[i + 1]);
+            else if (arg == "--file")
+                settings.file = argv[i + 1];
+            else
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        catch (std::exception&)
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    // Odd widths make every scanline padded, for RGB files
+    const Size sizes[] = {
+        { 160, 120, "thumbnail" },
+        { 333, 251, "small-odd" },
+        { 1920, 1080, "fhd" },
+        { 1999, 1001, "fhd-odd" },
+        { 3840, 2160, "4k" },
+        { 7680, 4320, "8k" },
+        { 7679, 4321, "8k-odd" },
+        { 15360, 8640, "16k" }
+    };
+
+    printf("benchmark,size,width,height,mode,iterations,ns_per_px,gb_per_s,allocs,alloc_bytes\n");
+    try
+    {
+        for (const Size& size : sizes)
+            if (size.width * size.height <= settings.maxPixels)
+                RunSize(settings, size);
+    }
+    catch (std::string& s)
+    {
+        std::cerr << s << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,700 @@
+// Checks every simd kernel of BMPlib against a plain scalar reference, and ConvertTo() for every pair of color modes.
+// Widths 0 to maxWidth (plus a few big ones), random pixels and all 255, in place wherever a kernel allows it and out of place.
+// Every simd variant the cpu supports gets checked on its own, not just the one the dispatcher picks.
+//
+// Build:  g++ -std=c++17 -O2 kernelcheck.cpp -o kernelcheck -lpthread
+//         (add -fsanitize=address to also catch loads and stores past the end of the buffers)
+// Usage:  kernelcheck [--max-width N] [--seed N]
+//
+// Prints one line per kernel, and exits with 1 if anything differs from the reference.
+
+#include <iostream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include "BMPlib.h"
+
+using namespace BMPlib;
+using namespace BMPlib::Kernels;
+
+struct Settings
+{
+    std::size_t maxWidth = 200;
+    unsigned seed = 1234;
+};
+
+// Kernel and reference both turn numPx pixels of src into dst
+typedef std::function<void(const byte* src, byte* dst, const std::size_t& numPx)> Kernel;
+
+// Simd variants only do part of the pixels. They return how many, or get told how many, and only those get compared
+typedef std::function<std::size_t(const byte* src, byte* dst, const std::size_t& numPx)> Variant;
+
+static std::mt19937 rng;
+static std::size_t numFailures = 0;
+
+static std::vector<std::size_t> GetWidths(const Settings& settings)
+{
+    std::vector<std::size_t> widths;
+    for (std::size_t i = 0; i <= settings.maxWidth; i++)
+        widths.push_back(i);
+
+    for (const std::size_t& big : { (std::size_t)1000, (std::size_t)1023, (std::size_t)4097 })
+        if (big > settings.maxWidth)
+            widths.push_back(big);
+
+    return widths;
+}
+
+// Random bytes, or all 255 to push the arithmetic to its limits
+static std::vector<byte> GetInput(const std::size_t& size, const bool& allMax)
+{
+    std::vector<byte> input(size);
+    for (byte& b : input)
+        b = allMax ? 255 : (byte)rng();
+
+    return input;
+}
+
+static void Report(const std::string& name, const std::size_t& numChecked, const std::string& firstFailure)
+{
+    if (firstFailure.empty())
+        printf("ok      %-40s %zu checks\n", name.c_str(), numChecked);
+    else
+    {
+        printf("FAILED  %-40s %s\n", name.c_str(), firstFailure.c_str());
+        numFailures++;
+    }
+
+    fflush(stdout);
+    return;
+}
+
+// Will compare kernel against reference, out of place and (if inPlace) with src and dst being the same buffer
+static void CheckKernel(const Settings& settings, const std::string& name, const std::size_t& srcBytes, const std::size_t& dstBytes, const bool& inPlace, const Kernel& kernel, const Kernel& reference)
+{
+    std::string firstFailure;
+    std::size_t numChecked = 0;
+
+    for (const std::size_t& numPx : GetWidths(settings))
+        for (const bool allMax : { false, true })
+        {
+            const std::vector<byte> src = GetInput(numPx * srcBytes, allMax);
+            std::vector<byte> expected(numPx * dstBytes);
+            reference(src.data(), expected.data(), numPx);
+
+            std::vector<byte> dst(numPx * dstBytes);
+            kernel(src.data(), dst.data(), numPx);
+            numChecked++;
+            if ((dst != expected) && (firstFailure.empty()))
+                firstFailure = "out of place, width " + std::to_string(numPx);
+
+            if (!inPlace)
+                continue;
+
+            std::vector<byte> buffer(numPx * (srcBytes > dstBytes ? srcBytes : dstBytes));
+            std::copy(src.begin(), src.end(), buffer.begin());
+            kernel(buffer.data(), buffer.data(), numPx);
+            numChecked++;
+            if ((!std::equal(expected.begin(), expected.end(), buffer.begin())) && (firstFailure.empty()))
+                firstFailure = "in place, width " + std::to_string(numPx);
+        }
+
+    Report(name, numChecked, firstFailure);
+    return;
+}
+
+#ifdef BMPLIB_X86_SIMD
+// Will compare the pixels variant did against reference, out of place and (if inPlace) in place
+static void CheckVariant(const Settings& settings, const std::string& name, const std::size_t& srcBytes, const std::size_t& dstBytes, const bool& inPlace, const Variant& variant, const Kernel& reference)
+{
+    std::string firstFailure;
+    std::size_t numChecked = 0;
+
+    for (const std::size_t& numPx : GetWidths(settings))
+        for (const bool allMax : { false, true })
+        {
+            const std::vector<byte> src = GetInput(numPx * srcBytes, allMax);
+            std::vector<byte> expected(numPx * dstBytes);
+            reference(src.data(), expected.data(), numPx);
+
+            std::vector<byte> dst(numPx * dstBytes);
+            std::size_t numDone = variant(src.data(), dst.data(), numPx);
+            numChecked++;
+            if ((numDone > numPx) || (!std::equal(dst.begin(), dst.begin() + numDone * dstBytes, expected.begin())))
+                if (firstFailure.empty())
+                    firstFailure = "out of place, width " + std::to_string(numPx);
+
+            if (!inPlace)
+                continue;
+
+            std::vector<byte> buffer(numPx * (srcBytes > dstBytes ? srcBytes : dstBytes));
+            std::copy(src.begin(), src.end(), buffer.begin());
+            numDone = variant(buffer.data(), buffer.data(), numPx);
+            numChecked++;
+            if ((numDone > numPx) || (!std::equal(buffer.begin(), buffer.begin() + numDone * dstBytes, expected.begin())))
+                if (firstFailure.empty())
+                    firstFailure = "in place, width " + std::to_string(numPx);
+        }
+
+    Report(name, numChecked, firstFailure);
+    return;
+}
+
+#endif
+
+// Scalar references. Growing ones go back to front, so they work in place, too
+
+static void SwapRB(const byte* src, byte* dst, const std::size_t& numPx, const std::size_t& numChannels)
+{
+    for (std::size_t i = 0; i < numPx; i++)
+    {
+        const byte r = src[i * numChannels + 0];
+        const byte g = src[i * numChannels + 1];
+        const byte b = src[i * numChannels + 2];
+        const byte a = numChannels == 4 ? src[i * numChannels + 3] : 0;
+        dst[i * numChannels + 0] = b;
+        dst[i * numChannels + 1] = g;
+        dst[i * numChannels + 2] = r;
+        if (numChannels == 4)
+            dst[i * numChannels + 3] = a;
+    }
+
+    return;
+}
+
+// See the rounding contract at GrayWeights
+static byte Gray(const byte* px, const GrayWeights& weights)
+{
+    return (byte)((px[0] * weights.r + px[1] * weights.g + px[2] * weights.b) >> weights.shift);
+}
+
+static void ToGray(const byte* src, byte* dst, const std::size_t& numPx, const std::size_t& numChannels, const GrayWeights& weights)
+{
+    for (std::size_t i = 0; i < numPx; i++)
+        dst[i] = Gray(src + i * numChannels, weights);
+
+    return;
+}
+
+static void Rgba32ToRgb24Reference(const byte* src, byte* dst, const std::size_t& numPx)
+{
+    for (std::size_t i = 0; i < numPx; i++)
+    {
+        const byte r = src[i * 4 + 0];
+        const byte g = src[i * 4 + 1];
+        const byte b = src[i * 4 + 2];
+        dst[i * 3 + 0] = r;
+        dst[i * 3 + 1] = g;
+        dst[i * 3 + 2] = b;
+    }
+
+    return;
+}
+
+static void GrayToRgbReference(const byte* src, byte* dst, const std::size_t& numPx, const std::size_t& numChannels)
+{
+    for (std::size_t i = numPx; i-- > 0;)
+    {
+        const byte v = src[i];
+        dst[i * numChannels + 0] = v;
+        dst[i * numChannels + 1] = v;
+        dst[i * numChannels + 2] = v;
+        if (numChannels == 4)
+            dst[i * numChannels + 3] = 0xFF;
+    }
+
+    return;
+}
+
+static void Rgb24ToRgba32Reference(const byte* src, byte* dst, const std::size_t& numPx)
+{
+    for (std::size_t i = numPx; i-- > 0;)
+    {
+        const byte r = src[i * 3 + 0];
+        const byte g = src[i * 3 + 1];
+        const byte b = src[i * 3 + 2];
+        dst[i * 4 + 0] = r;
+        dst[i * 4 + 1] = g;
+        dst[i * 4 + 2] = b;
+        dst[i * 4 + 3] = 0xFF;
+    }
+
+    return;
+}
+
+// See the rounding contract at Rgb16Layout. dither repeats every 4 pixels
+static void ToRgb16Reference(const byte* src, byte* dst, const std::size_t& numPx, const std::size_t& numChannels, const Rgb16Layout& layout, const byte* dither)
+{
+    const int greenMax = (1 << layout.greenBits) - 1;
+    for (std::size_t i = 0; i < numPx; i++)
+    {
+        const byte* px = src + i * numChannels;
+        const byte* d = dither + (i % 4) * 4;
+        const int r = (px[0] * 31 + d[0]) / 255;
+        const int g = (px[1] * greenMax + d[1]) / 255;
+        const int b = (px[2] * 31 + d[2]) / 255;
+        const int v = (r << layout.redShift) | (g << 5) | b;
+        dst[i * 2 + 0] = (byte)(v & 0xFF);
+        dst[i * 2 + 1] = (byte)(v >> 8);
+    }
+
+    return;
+}
+
+// Top bits get repeated into the low bits
+static byte Expand(const int& value, const int& numBits)
+{
+    int expanded = 0;
+    for (int bit = 7; bit >= 0; bit--)
+        expanded |= ((value >> (numBits - 1 - (7 - bit) % numBits)) & 1) << bit;
+
+    return (byte)expanded;
+}
+
+static void Rgb16ToRgb24Reference(const byte* src, byte* dst, const std::size_t& numPx, const Rgb16Layout& layout)
+{
+    for (std::size_t i = 0; i < numPx; i++)
+    {
+        const int v = src[i * 2] | (src[i * 2 + 1] << 8);
+        dst[i * 3 + 0] = Expand((v >> layout.redShift) & 0x1F, 5);
+        dst[i * 3 + 1] = Expand((v >> 5) & ((1 << layout.greenBits) - 1), layout.greenBits);
+        dst[i * 3 + 2] = Expand(v & 0x1F, 5);
+    }
+
+    return;
+}
+
+static void CheckSwizzles(const Settings& settings)
+{
+    CheckKernel(settings, "SwapRB24", 3, 3, true, SwapRB24, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 3); });
+    CheckKernel(settings, "SwapRB32", 4, 4, true, SwapRB32, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 4); });
+    CheckKernel(settings, "Rgba32ToRgb24", 4, 3, true, Rgba32ToRgb24, Rgba32ToRgb24Reference);
+    CheckKernel(settings, "GrayToRgb24", 1, 3, true, GrayToRgb24, [](const byte* s, byte* d, const std::size_t& n) { GrayToRgbReference(s, d, n, 3); });
+    CheckKernel(settings, "GrayToRgba32", 1, 4, true, GrayToRgba32, [](const byte* s, byte* d, const std::size_t& n) { GrayToRgbReference(s, d, n, 4); });
+    CheckKernel(settings, "Rgb24ToRgba32", 3, 4, true, Rgb24ToRgba32, Rgb24ToRgba32Reference);
+
+#ifdef BMPLIB_X86_SIMD
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.ssse3)
+    {
+        CheckVariant(settings, "SwapRB24_SSSE3", 3, 3, true, SwapRB24_SSSE3, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 3); });
+        CheckVariant(settings, "Rgba32ToRgb24_SSSE3", 4, 3, true, Rgba32ToRgb24_SSSE3, Rgba32ToRgb24Reference);
+
+        // Growing variants do exactly the pixels they get, which has to be what their dispatchers hand them
+        CheckVariant(settings, "GrayToRgb24_SSSE3", 1, 3, true, [](const byte* s, byte* d, const std::size_t& n)
+        {
+            GrayToRgb24_SSSE3(s, d, n - n % 16);
+            return n - n % 16;
+        }, [](const byte* s, byte* d, const std::size_t& n) { GrayToRgbReference(s, d, n, 3); });
+
+        CheckVariant(settings, "Rgb24ToRgba32_SSSE3", 3, 4, true, [](const byte* s, byte* d, const std::size_t& n)
+        {
+            const std::size_t numSimdPx = n >= 2 ? (n - 2) - (n - 2) % 4 : 0;
+            Rgb24ToRgba32_SSSE3(s, d, numSimdPx);
+            return numSimdPx;
+        }, Rgb24ToRgba32Reference);
+    }
+
+    if (cpu.sse2)
+    {
+        CheckVariant(settings, "SwapRB32_SSE2", 4, 4, true, SwapRB32_SSE2, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 4); });
+        CheckVariant(settings, "GrayToRgba32_SSE2", 1, 4, true, [](const byte* s, byte* d, const std::size_t& n)
+        {
+            GrayToRgba32_SSE2(s, d, n - n % 16);
+            return n - n % 16;
+        }, [](const byte* s, byte* d, const std::size_t& n) { GrayToRgbReference(s, d, n, 4); });
+    }
+
+    if (cpu.avx2)
+    {
+        CheckVariant(settings, "SwapRB24_AVX2", 3, 3, true, SwapRB24_AVX2, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 3); });
+        CheckVariant(settings, "SwapRB32_AVX2", 4, 4, true, SwapRB32_AVX2, [](const byte* s, byte* d, const std::size_t& n) { SwapRB(s, d, n, 4); });
+        CheckVariant(settings, "Rgba32ToRgb24_AVX2", 4, 3, true, Rgba32ToRgb24_AVX2, Rgba32ToRgb24Reference);
+        CheckVariant(settings, "Rgb24ToRgba32_AVX2", 3, 4, true, [](const byte* s, byte* d, const std::size_t& n)
+        {
+            const std::size_t numSimdPx = n >= 2 ? (n - 2) - (n - 2) % 8 : 0;
+            Rgb24ToRgba32_AVX2(s, d, numSimdPx);
+            return numSimdPx;
+        }, Rgb24ToRgba32Reference);
+    }
+#endif
+
+    return;
+}
+
+static void CheckGray(const Settings& settings)
+{
+    // Both weightings, and the color one the way round BGR images use it
+    GrayWeights bgrWeights = grayWeightsColor;
+    std::swap(bgrWeights.r, bgrWeights.b);
+
+    const std::pair<const char*, GrayWeights> weightings[] = {
+        { "color", grayWeightsColor },
+        { "noncolor", grayWeightsNonColor },
+        { "color bgr", bgrWeights }
+    };
+
+    for (const auto& weighting : weightings)
+    {
+        const GrayWeights weights = weighting.second;
+        const std::string suffix = std::string(" (") + weighting.first + ")";
+        const Kernel reference24 = [weights](const byte* s, byte* d, const std::size_t& n) { ToGray(s, d, n, 3, weights); };
+        const Kernel reference32 = [weights](const byte* s, byte* d, const std::size_t& n) { ToGray(s, d, n, 4, weights); };
+
+        CheckKernel(settings, "Rgb24ToGray" + suffix, 3, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { Rgb24ToGray(s, d, n, weights); }, reference24);
+        CheckKernel(settings, "Rgba32ToGray" + suffix, 4, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { Rgba32ToGray(s, d, n, weights); }, reference32);
+
+#ifdef BMPLIB_X86_SIMD
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.ssse3)
+            CheckVariant(settings, "Rgb24ToGray_SSSE3" + suffix, 3, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { return Rgb24ToGray_SSSE3(s, d, n, weights); }, reference24);
+        if (cpu.sse2)
+            CheckVariant(settings, "Rgba32ToGray_SSE2" + suffix, 4, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { return Rgba32ToGray_SSE2(s, d, n, weights); }, reference32);
+        if (cpu.avx2)
+        {
+            CheckVariant(settings, "Rgb24ToGray_AVX2" + suffix, 3, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { return Rgb24ToGray_AVX2(s, d, n, weights); }, reference24);
+            CheckVariant(settings, "Rgba32ToGray_AVX2" + suffix, 4, 1, true, [weights](const byte* s, byte* d, const std::size_t& n) { return Rgba32ToGray_AVX2(s, d, n, weights); }, reference32);
+        }
+#endif
+    }
+
+    return;
+}
+
+static void CheckRgb16(const Settings& settings)
+{
+    // Plain rounding, and a dither pattern
+    byte rounding[16];
+    byte pattern[16];
+    for (std::size_t i = 0; i < 16; i++)
+    {
+        rounding[i] = 127;
+        pattern[i] = (byte)(i * 16 + 8);
+    }
+
+    const std::pair<const char*, Rgb16Layout> layouts[] = { { "565", rgb565 }, { "555", rgb555 } };
+    const std::pair<const char*, const byte*> dithers[] = { { "rounded", rounding }, { "dithered", pattern } };
+
+    for (const auto& layoutEntry : layouts)
+    {
+        const Rgb16Layout layout = layoutEntry.second;
+        const std::string layoutName = std::string(" (") + layoutEntry.first;
+
+        for (const auto& ditherEntry : dithers)
+        {
+            const byte* dither = ditherEntry.second;
+            const std::string suffix = layoutName + ", " + ditherEntry.first + ")";
+            const Kernel reference24 = [layout, dither](const byte* s, byte* d, const std::size_t& n) { ToRgb16Reference(s, d, n, 3, layout, dither); };
+            const Kernel reference32 = [layout, dither](const byte* s, byte* d, const std::size_t& n) { ToRgb16Reference(s, d, n, 4, layout, dither); };
+
+            CheckKernel(settings, "Rgb24ToRgb16" + suffix, 3, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { Rgb24ToRgb16(s, d, n, layout, dither); }, reference24);
+            CheckKernel(settings, "Rgba32ToRgb16" + suffix, 4, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { Rgba32ToRgb16(s, d, n, layout, dither); }, reference32);
+
+#ifdef BMPLIB_X86_SIMD
+            const CpuFeatures& cpu = GetCpuFeatures();
+            if (cpu.ssse3)
+                CheckVariant(settings, "Rgb24ToRgb16_SSSE3" + suffix, 3, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { return Rgb24ToRgb16_SSSE3(s, d, n, layout, dither); }, reference24);
+            if (cpu.sse2)
+                CheckVariant(settings, "Rgba32ToRgb16_SSE2" + suffix, 4, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { return Rgba32ToRgb16_SSE2(s, d, n, layout, dither); }, reference32);
+            if (cpu.avx2)
+            {
+                CheckVariant(settings, "Rgb24ToRgb16_AVX2" + suffix, 3, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { return Rgb24ToRgb16_AVX2(s, d, n, layout, dither); }, reference24);
+                CheckVariant(settings, "Rgba32ToRgb16_AVX2" + suffix, 4, 2, false, [layout, dither](const byte* s, byte* d, const std::size_t& n) { return Rgba32ToRgb16_AVX2(s, d, n, layout, dither); }, reference32);
+            }
+#endif
+        }
+
+        const std::string suffix = layoutName + ")";
+        const Kernel reference = [layout](const byte* s, byte* d, const std::size_t& n) { Rgb16ToRgb24Reference(s, d, n, layout); };
+        CheckKernel(settings, "Rgb16ToRgb24" + suffix, 2, 3, false, [layout](const byte* s, byte* d, const std::size_t& n) { Rgb16ToRgb24(s, d, n, layout); }, reference);
+
+#ifdef BMPLIB_X86_SIMD
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.ssse3)
+            CheckVariant(settings, "Rgb16ToRgb24_SSSE3" + suffix, 2, 3, false, [layout](const byte* s, byte* d, const std::size_t& n) { return Rgb16ToRgb24_SSSE3(s, d, n, layout); }, reference);
+        if (cpu.avx2)
+            CheckVariant(settings, "Rgb16ToRgb24_AVX2" + suffix, 2, 3, false, [layout](const byte* s, byte* d, const std::size_t& n) { return Rgb16ToRgb24_AVX2(s, d, n, layout); }, reference);
+#endif
+    }
+
+    return;
+}
+
+static void CheckOthers(const Settings& settings)
+{
+    // A palette that is nothing like the identity
+    byte palette[256 * 3];
+    for (std::size_t i = 0; i < sizeof(palette); i++)
+        palette[i] = (byte)rng();
+
+    CheckKernel(settings, "PaletteToRgb24", 1, 3, false, [&palette](const byte* s, byte* d, const std::size_t& n) { PaletteToRgb24(s, d, n, palette); },
+        [&palette](const byte* s, byte* d, const std::size_t& n)
+        {
+            for (std::size_t i = 0; i < n; i++)
+                for (std::size_t c = 0; c < 3; c++)
+                    d[i * 3 + c] = palette[s[i] * 3 + c];
+        });
+
+    // Sums come out of the src and dst bytes: 2 bytes of sums per pixel, starting at whatever is in dst (a copy of src, twice)
+    const auto accumulate = [](const std::function<std::size_t(const byte*, byte2*, const std::size_t&)>& run)
+    {
+        return [run](const byte* s, byte* d, const std::size_t& n)
+        {
+            std::vector<byte2> sums(n);
+            for (std::size_t i = 0; i < n; i++)
+                sums[i] = (byte2)(s[i] * 129);
+            const std::size_t numDone = run(s, sums.data(), n);
+            if (n)
+                memcpy(d, sums.data(), n * 2);
+            return numDone;
+        };
+    };
+    const Kernel accumulateReference = [](const byte* s, byte* d, const std::size_t& n)
+    {
+        for (std::size_t i = 0; i < n; i++)
+        {
+            const byte2 sum = (byte2)(s[i] * 129 + s[i]);
+            memcpy(d + i * 2, &sum, 2);
+        }
+    };
+
+    const auto accumulateAll = accumulate([](const byte* s, byte2* sums, const std::size_t& n) { AccumulateRow(s, sums, n); return n; });
+    CheckKernel(settings, "AccumulateRow", 1, 2, false, [accumulateAll](const byte* s, byte* d, const std::size_t& n) { accumulateAll(s, d, n); }, accumulateReference);
+
+    for (const std::size_t numChannels : { (std::size_t)1, (std::size_t)3, (std::size_t)4 })
+    {
+        const std::string suffix = " (" + std::to_string(numChannels) + " channels)";
+
+        // The pixel to fill with is the first one of src
+        CheckKernel(settings, "FillPixels" + suffix, numChannels, numChannels, false, [numChannels](const byte* s, byte* d, const std::size_t& n) { if (n) FillPixels(d, n, s, numChannels); },
+            [numChannels](const byte* s, byte* d, const std::size_t& n)
+            {
+                for (std::size_t i = 0; i < n * numChannels; i++)
+                    d[i] = s[i % numChannels];
+            });
+
+        CheckKernel(settings, "MirrorPixels" + suffix, numChannels, numChannels, false, [numChannels](const byte* s, byte* d, const std::size_t& n) { MirrorPixels(s, d, n, numChannels); },
+            [numChannels](const byte* s, byte* d, const std::size_t& n)
+            {
+                for (std::size_t i = 0; i < n; i++)
+                    for (std::size_t c = 0; c < numChannels; c++)
+                        d[i * numChannels + c] = s[(n - 1 - i) * numChannels + c];
+            });
+    }
+
+#ifdef BMPLIB_X86_SIMD
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        CheckVariant(settings, "AccumulateRow_SSE2", 1, 2, false, accumulate(AccumulateRow_SSE2), accumulateReference);
+    if (cpu.avx2)
+        CheckVariant(settings, "AccumulateRow_AVX2", 1, 2, false, accumulate(AccumulateRow_AVX2), accumulateReference);
+
+    for (const std::size_t numChannels : { (std::size_t)3, (std::size_t)4 })
+    {
+        const std::string suffix = " (" + std::to_string(numChannels) + " channels)";
+        const Kernel reference = [numChannels](const byte* s, byte* d, const std::size_t& n)
+        {
+            for (std::size_t i = 0; i < n * numChannels; i++)
+                d[i] = s[i % numChannels];
+        };
+
+        if (cpu.sse2)
+            CheckVariant(settings, "FillPixels_SSE2" + suffix, numChannels, numChannels, false, [numChannels](const byte* s, byte* d, const std::size_t& n) { return n ? FillPixels_SSE2(d, n, s, numChannels) : 0; }, reference);
+        if (cpu.avx2)
+            CheckVariant(settings, "FillPixels_AVX2" + suffix, numChannels, numChannels, false, [numChannels](const byte* s, byte* d, const std::size_t& n) { return n ? FillPixels_AVX2(d, n, s, numChannels) : 0; }, reference);
+    }
+
+    const auto mirrorReference = [](const std::size_t& numChannels)
+    {
+        return Kernel([numChannels](const byte* s, byte* d, const std::size_t& n)
+        {
+            for (std::size_t i = 0; i < n; i++)
+                for (std::size_t c = 0; c < numChannels; c++)
+                    d[i * numChannels + c] = s[(n - 1 - i) * numChannels + c];
+        });
+    };
+
+    if (cpu.ssse3)
+        CheckVariant(settings, "MirrorPixels24_SSSE3", 3, 3, false, MirrorPixels24_SSSE3, mirrorReference(3));
+    if (cpu.avx2)
+    {
+        CheckVariant(settings, "MirrorPixels8_AVX2", 1, 1, false, MirrorPixels8_AVX2, mirrorReference(1));
+        CheckVariant(settings, "MirrorPixels32_AVX2", 4, 4, false, MirrorPixels32_AVX2, mirrorReference(4));
+    }
+#endif
+
+    return;
+}
+
+static std::size_t NumChannels(const BMP::COLOR_MODE& mode)
+{
+    switch (mode)
+    {
+    case BMP::COLOR_MODE::BW:
+        return 1;
+    case BMP::COLOR_MODE::RGB:
+    case BMP::COLOR_MODE::BGR:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// Will turn one pixel of any mode into R-G-B-A
+static void ToRgba(const byte* px, const BMP::COLOR_MODE& mode, byte* rgba)
+{
+    switch (mode)
+    {
+    case BMP::COLOR_MODE::BW:
+        rgba[0] = rgba[1] = rgba[2] = px[0];
+        rgba[3] = 0xFF;
+        break;
+    case BMP::COLOR_MODE::RGB:
+        rgba[0] = px[0]; rgba[1] = px[1]; rgba[2] = px[2]; rgba[3] = 0xFF;
+        break;
+    case BMP::COLOR_MODE::RGBA:
+        rgba[0] = px[0]; rgba[1] = px[1]; rgba[2] = px[2]; rgba[3] = px[3];
+        break;
+    case BMP::COLOR_MODE::BGR:
+        rgba[0] = px[2]; rgba[1] = px[1]; rgba[2] = px[0]; rgba[3] = 0xFF;
+        break;
+    case BMP::COLOR_MODE::BGRA:
+        rgba[0] = px[2]; rgba[1] = px[1]; rgba[2] = px[0]; rgba[3] = px[3];
+        break;
+    }
+
+    return;
+}
+
+// ConvertTo() for every pair of color modes, both gray weightings, with and without a thread pool
+static void CheckConvertTo(const Settings& settings)
+{
+    const BMP::COLOR_MODE modes[] = { BMP::COLOR_MODE::BW, BMP::COLOR_MODE::RGB, BMP::COLOR_MODE::RGBA, BMP::COLOR_MODE::BGR, BMP::COLOR_MODE::BGRA };
+    const char* names[] = { "BW", "RGB", "RGBA", "BGR", "BGRA" };
+    std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>(3);
+
+    for (std::size_t from = 0; from < 5; from++)
+        for (std::size_t to = 0; to < 5; to++)
+            for (const bool isNonColorData : { false, true })
+            {
+                std::string firstFailure;
+                std::size_t numChecked = 0;
+
+                for (const std::size_t& width : GetWidths(settings))
+                    for (const std::size_t& height : { (std::size_t)1, (std::size_t)37 })
+                        for (const bool usePool : { false, true })
+                        {
+                            if ((!width) || ((usePool) && (width > 64)))
+                                continue;
+
+                            BMP bmp(width, height, modes[from], false);
+                            const std::vector<byte> src = GetInput(width * height * NumChannels(modes[from]), false);
+                            std::copy(src.begin(), src.end(), bmp.GetPixelBuffer());
+                            if (usePool)
+                                bmp.SetThreadPool(pool);
+
+                            bmp.ConvertTo(modes[to], isNonColorData);
+                            numChecked++;
+
+                            // Same thing, one pixel at a time
+                            const std::size_t srcChannels = NumChannels(modes[from]);
+                            const std::size_t dstChannels = NumChannels(modes[to]);
+                            const GrayWeights weights = isNonColorData ? grayWeightsNonColor : grayWeightsColor;
+                            std::vector<byte> expected(width * height * dstChannels);
+                            for (std::size_t i = 0; i < width * height; i++)
+                            {
+                                byte rgba[4] = { 0, 0, 0, 0xFF };
+                                ToRgba(src.data() + i * srcChannels, modes[from], rgba);
+                                if (modes[from] == modes[to])
+                                    memcpy(&expected[i * dstChannels], src.data() + i * srcChannels, srcChannels);
+                                else if (modes[to] == BMP::COLOR_MODE::BW)
+                                    expected[i] = modes[from] == BMP::COLOR_MODE::BW ? rgba[0] : Gray(rgba, weights);
+                                else
+                                {
+                                    byte* px = &expected[i * dstChannels];
+                                    const bool isBgr = (modes[to] == BMP::COLOR_MODE::BGR) || (modes[to] == BMP::COLOR_MODE::BGRA);
+                                    px[0] = rgba[isBgr ? 2 : 0];
+                                    px[1] = rgba[1];
+                                    px[2] = rgba[isBgr ? 0 : 2];
+                                    if (dstChannels == 4)
+                                        px[3] = rgba[3];
+                                }
+                            }
+
+                            if ((bmp.GetColorMode() != modes[to]) || (!std::equal(expected.begin(), expected.end(), bmp.GetPixelBuffer())))
+                                if (firstFailure.empty())
+                                    firstFailure = std::to_string(width) + "x" + std::to_string(height) + (usePool ? " with thread pool" : "");
+                        }
+
+                Report(std::string("ConvertTo ") + names[from] + " -> " + names[to] + (isNonColorData ? " (noncolor)" : ""), numChecked, firstFailure);
+            }
+
+    return;
+}
+
+static void PrintUsage()
+{
+    std::cerr << "Usage: kernelcheck [--max-width N] [--seed N]" << std::endl;
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    Settings settings;
+
+    // Every option takes a value
+    if (argc % 2 == 0)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        try
+        {
+            if (arg == "--max-width")
+                settings.maxWidth = std::stoull(argv[i + 1]);
+            else if (arg == "--seed")
+                settings.seed = (unsigned)std::stoul(argv[i + 1]);
+            else
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        catch (std::exception&)
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    rng.seed(settings.seed);
+
+    try
+    {
+        CheckSwizzles(settings);
+        CheckGray(settings);
+        CheckRgb16(settings);
+        CheckOthers(settings);
+        CheckConvertTo(settings);
+    }
+    catch (std::string& s)
+    {
+        std::cerr << s << std::endl;
+        return 1;
+    }
+
+    if (numFailures)
+    {
+        printf("%zu kernels FAILED\n", numFailures);
+        return 1;
+    }
+
+    printf("all kernels match the reference\n");
+    return 0;
+}
@@ -58,12 +58,15 @@ void Example3()
     // Another example
     // Create image object of size 800x600px
     BMP bmp(800, 600);
-    
-    // Generate nice color gradient image
-    for (std::size_t x = 0; x < 800; x++)
-        for (std::size_t y = 0; y < 600; y++)
+
+    // The view knows at compile time that the image is RGB, so setting a pixel is just three stores
+    ImageView<BMP::COLOR_MODE::RGB> view(bmp);
+
+    // Generate nice color gradient image. Row by row, since that's how the pixels lie in memory
+    for (std::size_t y = 0; y < 600; y++)
+        for (std::size_t x = 0; x < 800; x++)
         {
-            bmp.SetPixel(x, y,
+            view.SetPixel(x, y,
                 (byte)(       ((double)x / 800.0) * 255.0),
                 (byte)((1.0 - ((double)x / 800.0)) * 255.0),
                 (byte)((1.0 - ((double)y / 800.0)) * 255.0),
@@ -132,10 +135,14 @@ void ExampleDiamonds()
 
     // 62 is the pixel size of a diamond
     BMP bmp(62 * 10 , 62 * 6, BMP::COLOR_MODE::BW);
+    ImageView<BMP::COLOR_MODE::BW> view(bmp);
 
-    for (std::size_t x = 0; x < bmp.GetWidth(); x++)
-        for (std::size_t y = 0; y < bmp.GetHeight(); y++)
-            bmp.SetPixel(x, y, tan(x / 20.0) * tan(y / 20.0) * 255);
+    for (auto row : view)
+    {
+        std::size_t x = 0;
+        for (byte* px : row)
+            *px = tan(x++ / 20.0) * tan(row.GetY() / 20.0) * 255;
+    }
 
 
     bmp.Write("diamonds.bmp");
@@ -0,0 +1,475 @@
+// Batch transcoder: Runs a list of operations over every bmp in a directory.
+// Reading, transforming and writing run as overlapping pipeline stages, connected by bounded queues.
+//
+// Build:  g++ -std=c++17 -O2 transcoder.cpp -o transcoder -lpthread
+// Usage:  transcoder <input dir> <output dir> [operations...] [--threads N] [--queue N]
+//
+// Operations run in the order given:
+//   convert=bw|rgb|rgba|bgr|bgra   change color mode
+//   crop=x,y,width,height   cut out a rectangle. As the first operation, only the rectangle gets read from the file
+//   downscale=N             shrink by an integer factor, averaging NxN blocks. As the first operation, 2, 4 and 8 happen while reading
+//
+// Example: transcoder scans/ scans_bw/ crop=0,0,2000,1000 convert=bw
+
+#include <iostream>
+#include <filesystem>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+#include <algorithm>
+#include <cctype>
+#define BMPLIB_INSTRUMENT // only for counting the bytes that actually get read. A crop reads a lot less than the whole file
+#include "BMPlib.h"
+
+using namespace BMPlib;
+namespace fs = std::filesystem;
+
+// Blocks producers while full, and consumers while empty.
+// Once closed, Pop() hands out what's left and then returns nothing
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity)
+        : capacity{capacity ? capacity : 1}
+    {
+        return;
+    }
+
+    void Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return;
+    }
+
+    std::optional<T> Pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&]() { return (!items.empty()) || (closed); });
+        if (items.empty())
+            return std::nullopt;
+
+        T item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+
+    // No more pushes after this
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        return;
+    }
+
+private:
+    std::deque<T> items;
+    std::size_t capacity;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+struct Operation
+{
+    enum class TYPE
+    {
+        CONVERT,
+        CROP,
+        DOWNSCALE
+    };
+
+    TYPE type;
+    BMP::COLOR_MODE colorMode = BMP::COLOR_MODE::RGB;
+    std::size_t x = 0, y = 0, width = 0, height = 0;
+    std::size_t factor = 1;
+};
+
+struct Job
+{
+    fs::path outputPath;
+    BMP bmp;
+};
+
+bool ParseOperation(const std::string& arg, Operation& op)
+{
+    const std::size_t eq = arg.find('=');
+    if (eq == std::string::npos)
+        return false;
+
+    const std::string name = arg.substr(0, eq);
+    const std::string value = arg.substr(eq + 1);
+
+    try
+    {
+        if (name == "convert")
+        {
+            op.type = Operation::TYPE::CONVERT;
+            if (value == "bw")
+                op.colorMode = BMP::COLOR_MODE::BW;
+            else if (value == "rgb")
+                op.colorMode = BMP::COLOR_MODE::RGB;
+            else if (value == "rgba")
+                op.colorMode = BMP::COLOR_MODE::RGBA;
+            else if (value == "bgr")
+                op.colorMode = BMP::COLOR_MODE::BGR;
+            else if (value == "bgra")
+                op.colorMode = BMP::COLOR_MODE::BGRA;
+            else
+                return false;
+            return true;
+        }
+        else if (name == "crop")
+        {
+            op.type = Operation::TYPE::CROP;
+            std::size_t pos = 0;
+            std::size_t* fields[] = { &op.x, &op.y, &op.width, &op.height };
+            for (std::size_t i = 0; i < 4; i++)
+            {
+                std::size_t used;
+                *fields[i] = std::stoul(value.substr(pos), &used);
+                pos += used;
+                if ((i < 3) && ((pos >= value.size()) || (value[pos++] != ',')))
+                    return false;
+            }
+            return (pos == value.size()) && (op.width) && (op.height);
+        }
+        else if (name == "downscale")
+        {
+            op.type = Operation::TYPE::DOWNSCALE;
+            op.factor = std::stoul(value);
+            return op.factor > 0;
+        }
+    }
+    catch (std::exception&)
+    {
+        return false;
+    }
+
+    return false;
+}
+
+std::size_t NumChannels(const BMP::COLOR_MODE& colorMode)
+{
+    switch (colorMode)
+    {
+    case BMP::COLOR_MODE::BW:
+        return 1;
+    case BMP::COLOR_MODE::RGB:
+    case BMP::COLOR_MODE::BGR:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// Will cut out a rectangle, clipped to the image. Reuses scratch's pixel buffer, and swaps it with bmp
+void Crop(BMP& bmp, BMP& scratch, const Operation& op)
+{
+    if ((op.x >= bmp.GetWidth()) || (op.y >= bmp.GetHeight()))
+        throw std::string("Crop rectangle lies outside of the image!");
+
+    const std::size_t width = std::min(op.width, bmp.GetWidth() - op.x);
+    const std::size_t height = std::min(op.height, bmp.GetHeight() - op.y);
+    const std::size_t numChannels = NumChannels(bmp.GetColorMode());
+
+    scratch.ReInitialize(width, height, bmp.GetColorMode(), false);
+    for (std::size_t y = 0; y < height; y++)
+        memcpy(scratch.GetPixelBuffer() + y * width * numChannels,
+               bmp.GetPixelBuffer() + bmp.CalculatePixelIndex(op.x, op.y + y),
+               width * numChannels);
+
+    bmp.Swap(scratch);
+    return;
+}
+
+// Will shrink the image by factor, averaging factor x factor blocks.
+// Blocks at the right and bottom edges average the pixels they've got, just like ReadOptions::downscale does
+void Downscale(BMP& bmp, BMP& scratch, const Operation& op)
+{
+    const std::size_t factor = op.factor;
+    if (factor == 1)
+        return;
+
+    const std::size_t srcWidth = bmp.GetWidth();
+    const std::size_t srcHeight = bmp.GetHeight();
+    const std::size_t width = (srcWidth + factor - 1) / factor;
+    const std::size_t height = (srcHeight + factor - 1) / factor;
+    const std::size_t numChannels = NumChannels(bmp.GetColorMode());
+    const std::size_t srcRowSize = srcWidth * numChannels;
+
+    scratch.ReInitialize(width, height, bmp.GetColorMode(), false);
+    std::vector<std::size_t> sums(width * numChannels);
+    for (std::size_t y = 0; y < height; y++)
+    {
+        const std::size_t blockHeight = std::min(factor, srcHeight - y * factor);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (std::size_t sy = 0; sy < blockHeight; sy++)
+        {
+            const byte* src = bmp.GetPixelBuffer() + (y * factor + sy) * srcRowSize;
+            for (std::size_t sx = 0; sx < srcWidth; sx++)
+                for (std::size_t c = 0; c < numChannels; c++)
+                    sums[(sx / factor) * numChannels + c] += src[sx * numChannels + c];
+        }
+
+        byte* dst = scratch.GetPixelBuffer() + y * width * numChannels;
+        for (std::size_t x = 0; x < width; x++)
+        {
+            const std::size_t blockSize = std::min(factor, srcWidth - x * factor) * blockHeight;
+            for (std::size_t c = 0; c < numChannels; c++)
+                dst[x * numChannels + c] = (byte)((sums[x * numChannels + c] + blockSize / 2) / blockSize);
+        }
+    }
+
+    bmp.Swap(scratch);
+    return;
+}
+
+void Transform(BMP& bmp, BMP& scratch, const std::vector<Operation>& operations)
+{
+    for (const Operation& op : operations)
+    {
+        switch (op.type)
+        {
+        case Operation::TYPE::CONVERT:
+            bmp.ConvertTo(op.colorMode);
+            break;
+
+        case Operation::TYPE::CROP:
+            Crop(bmp, scratch, op);
+            break;
+
+        case Operation::TYPE::DOWNSCALE:
+            Downscale(bmp, scratch, op);
+            break;
+        }
+    }
+    return;
+}
+
+void PrintUsage()
+{
+    std::cerr << "Usage: transcoder <input dir> <output dir> [convert=bw|rgb|rgba|bgr|bgra] [crop=x,y,w,h] [downscale=N] [--threads N] [--queue N]" << std::endl;
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const fs::path inputDir = argv[1];
+    const fs::path outputDir = argv[2];
+    std::vector<Operation> operations;
+    std::size_t numThreads = std::thread::hardware_concurrency();
+    std::size_t queueSize = 4;
+
+    for (int i = 3; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (((arg == "--threads") || (arg == "--queue")) && (i + 1 < argc))
+        {
+            try
+            {
+                (arg == "--threads" ? numThreads : queueSize) = std::stoul(argv[++i]);
+            }
+            catch (std::exception&)
+            {
+                PrintUsage();
+                return 1;
+            }
+            continue;
+        }
+
+        Operation op;
+        if (!ParseOperation(arg, op))
+        {
+            std::cerr << "Bad operation: " << arg << std::endl;
+            PrintUsage();
+            return 1;
+        }
+        operations.push_back(op);
+    }
+    if (!numThreads)
+        numThreads = 1;
+
+    // A crop right at the start doesn't need the whole image. Only the rows and bytes it covers get read
+    std::optional<Operation> leadingCrop;
+    if ((!operations.empty()) && (operations.front().type == Operation::TYPE::CROP))
+    {
+        leadingCrop = operations.front();
+        operations.erase(operations.begin());
+    }
+
+    // Same goes for shrinking by 2, 4 or 8, which happens a scanline at a time while reading. Reading a rectangle can't do that too, so it's one or the other
+    ReadOptions readOptions;
+    if ((!leadingCrop) && (!operations.empty()) && (operations.front().type == Operation::TYPE::DOWNSCALE) &&
+        ((operations.front().factor == 2) || (operations.front().factor == 4) || (operations.front().factor == 8)))
+    {
+        readOptions.downscale = operations.front().factor;
+        operations.erase(operations.begin());
+    }
+
+    std::vector<fs::path> inputs;
+    try
+    {
+        for (const fs::directory_entry& entry : fs::directory_iterator(inputDir))
+        {
+            std::string extension = entry.path().extension().string();
+            for (char& c : extension)
+                c = (char)tolower((unsigned char)c);
+
+            if ((entry.is_regular_file()) && (extension == ".bmp"))
+                inputs.push_back(entry.path());
+        }
+        fs::create_directories(outputDir);
+    }
+    catch (fs::filesystem_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // Pixel buffers get recycled between images, instead of going back to the OS every time
+    std::shared_ptr<PixelBufferPool> bufferPool = std::make_shared<PixelBufferPool>();
+    ThreadPool threadPool(numThreads);
+
+    BoundedQueue<Job> decoded(queueSize);
+    BoundedQueue<Job> transformed(queueSize);
+    std::atomic<std::size_t> bytesRead{0};
+    std::atomic<std::size_t> bytesWritten{0};
+    std::atomic<std::size_t> numDone{0};
+    std::atomic<std::size_t> numFailed{0};
+    std::mutex errorMutex;
+
+    const auto reportError = [&](const fs::path& path, const std::string& what)
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        std::cerr << path.string() << ": " << what << std::endl;
+        numFailed++;
+        return;
+    };
+
+    // Only the reader stage reads, so whatever the read counters grew by during one Read() is what that Read() read
+    const auto getBytesRead = []()
+    {
+        const Instrumentation::Counters counters = Instrumentation::GetCounters(Instrumentation::OPERATION::READ);
+        return (std::size_t)(counters.phases[(std::size_t)Instrumentation::PHASE::HEADER].bytes + counters.phases[(std::size_t)Instrumentation::PHASE::IO].bytes);
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // Stage 1: Read
+    std::thread reader([&]()
+    {
+        for (const fs::path& path : inputs)
+        {
+            Job job{ outputDir / path.filename(), BMP(bufferPool) };
+            const std::size_t bytesBefore = getBytesRead();
+            try
+            {
+                const bool success = leadingCrop ?
+                    job.bmp.Read(path.string(), leadingCrop->x, leadingCrop->y, leadingCrop->width, leadingCrop->height) :
+                    job.bmp.Read(path.string(), readOptions);
+
+                if (!success)
+                {
+                    reportError(path, leadingCrop ? "Can't read, or crop rectangle lies outside of the image" : "Can't read");
+                    continue;
+                }
+            }
+            catch (std::string& s)
+            {
+                reportError(path, s);
+                continue;
+            }
+
+            bytesRead += getBytesRead() - bytesBefore;
+            decoded.Push(std::move(job));
+        }
+        decoded.Close();
+        return;
+    });
+
+    // Stage 2: Transform, on every worker of the pool
+    std::atomic<std::size_t> numTransformers{numThreads};
+    for (std::size_t i = 0; i < numThreads; i++)
+    {
+        threadPool.Submit([&]()
+        {
+            BMP scratch(bufferPool);
+            while (std::optional<Job> job = decoded.Pop())
+            {
+                try
+                {
+                    Transform(job->bmp, scratch, operations);
+                    transformed.Push(std::move(*job));
+                }
+                catch (std::string& s)
+                {
+                    reportError(job->outputPath, s);
+                }
+            }
+
+            if (--numTransformers == 0)
+                transformed.Close();
+            return;
+        });
+    }
+
+    // Stage 3: Write
+    std::thread writer([&]()
+    {
+        while (std::optional<Job> job = transformed.Pop())
+        {
+            try
+            {
+                if (!job->bmp.Write(job->outputPath.string()))
+                {
+                    reportError(job->outputPath, "Can't write");
+                    continue;
+                }
+            }
+            catch (std::string& s)
+            {
+                reportError(job->outputPath, s);
+                continue;
+            }
+
+            std::error_code error;
+            const std::uintmax_t fileSize = fs::file_size(job->outputPath, error);
+            if (!error)
+                bytesWritten += fileSize;
+            numDone++;
+        }
+        return;
+    });
+
+    reader.join();
+    writer.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double megabytes = (bytesRead + bytesWritten) / (1024.0 * 1024.0);
+
+    std::cout << numDone << " images transcoded, " << numFailed << " failed, in " << seconds << " s" << std::endl;
+    std::cout << numDone / seconds << " images/s, "
+              << megabytes / seconds << " MB/s (" << bytesRead / (1024.0 * 1024.0) << " MB read, "
+              << bytesWritten / (1024.0 * 1024.0) << " MB written)" << std::endl;
+
+    return numFailed ? 2 : 0;
+}